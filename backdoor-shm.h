@@ -0,0 +1,143 @@
+/* Read-only access to the live variables of a backdoor-framework server.
+ *
+ * A server started with "-M NAME" keeps a copy of the named variables and the trip count of every device in the POSIX
+ * shared memory object NAME (e.g., "/backdoor").  A local program that maps the object can poll the state of any device
+ * without a system call and without sending commands to the server.  This header is all such a program needs:
+ *
+ *     const struct BdShmHeader *h = bdshm_open("/backdoor");
+ *     uint32_t values[BDSHM_MAX_VARS];
+ *     uint64_t ntrips;
+ *     if (h && bdshm_read(h, 17, values, &ntrips))
+ *         printf("%s=%u\n", bdshm_vars(h)[1].name, values[1]);
+ *
+ * Layout: a struct BdShmHeader, followed by nvars struct BdShmVar describing the variables, followed at devices_offset by
+ * one record of record_len bytes per device.  A record is a struct BdShmDevice followed by the device's nvars variables,
+ * each a 32-bit value in stored units (a value with frac_digits fraction digits counts 10^-frac_digits units).
+ *
+ * Each record is published through a sequence lock.  The server makes seq odd while it changes the record and even again
+ * afterwards, so a copy taken between two reads of the same even seq is consistent.  A command that changes several
+ * variables of a device is published as a single update.  The server clears magic when it exits, including on SIGTERM
+ * and SIGINT, and a server that starts with the same NAME creates a new object rather than reusing the old one.  A server
+ * killed some other way leaves magic set, so bdshm_open and bdshm_read also check that the server's pid is still alive.
+ */
+#ifndef BACKDOOR_SHM_H
+#define BACKDOOR_SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BDSHM_MAGIC 0x4d484442                          /* "BDHM" */
+#define BDSHM_VERSION 1
+#define BDSHM_MAX_VARS 256
+#define BDSHM_NAME_LEN 32
+
+struct BdShmHeader {
+    volatile uint32_t magic;                            /* BDSHM_MAGIC while the server is running */
+    uint32_t version;
+    uint32_t ndevices;
+    uint32_t nvars;                                     /* variables per device, at most BDSHM_MAX_VARS */
+    uint32_t record_len;                                /* bytes per device record, a multiple of 64 */
+    uint32_t devices_offset;                            /* offset of device 0's record from the start of the object */
+    uint64_t size;                                      /* bytes in the object */
+    uint32_t pid;                                       /* process ID of the server */
+    uint32_t reserved;
+};
+
+struct BdShmVar {
+    char name[BDSHM_NAME_LEN];                          /* variable name, or empty for an unnamed variable */
+    uint32_t frac_digits;                               /* digits after the decimal point */
+    uint32_t reserved;
+};
+
+struct BdShmDevice {
+    volatile uint32_t seq;                              /* odd while the record is changing */
+    uint32_t reserved;
+    uint64_t ntrips;                                    /* number of times the breaker has tripped */
+    uint32_t values[];                                  /* nvars values */
+};
+
+static inline const struct BdShmVar *
+bdshm_vars(const struct BdShmHeader *h) {
+    return (const struct BdShmVar *)(h + 1);
+}
+
+static inline const struct BdShmDevice *
+bdshm_device(const struct BdShmHeader *h, unsigned id) {
+    return (const struct BdShmDevice *)((const uint8_t *)h + h->devices_offset + (size_t)id * h->record_len);
+}
+
+/* Returns non-zero if the server that exported H is still running. */
+static inline int
+bdshm_alive(const struct BdShmHeader *h) {
+    return h->magic == BDSHM_MAGIC && !(kill(h->pid, 0) < 0 && errno == ESRCH);
+}
+
+/* Maps the shared memory object NAME read-only.  Returns null if there's no such object or it isn't a server's export. */
+static inline const struct BdShmHeader *
+bdshm_open(const char *name) {
+    const struct BdShmHeader *h;
+    struct stat sb;
+    void *p = MAP_FAILED;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+        return NULL;
+    if (fstat(fd, &sb) == 0 && (size_t)sb.st_size >= sizeof *h)
+        p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    h = p;
+    if (h->magic != BDSHM_MAGIC || h->version != BDSHM_VERSION || h->size > (uint64_t)sb.st_size ||
+        h->nvars > BDSHM_MAX_VARS || !bdshm_alive(h)) {
+        munmap(p, sb.st_size);
+        return NULL;
+    }
+    return h;
+}
+
+static inline void
+bdshm_close(const struct BdShmHeader *h) {
+    munmap((void *)h, h->size);
+}
+
+/* Copies a consistent snapshot of device ID's variables into VALUES (h->nvars of them) and its trip count into *NTRIPS,
+ * unless NTRIPS is null.  Returns 0 if there's no device ID or the server has exited, and 1 otherwise.  To stay free of
+ * system calls, it checks that the server is still running only on every 1024th call and every 65536th spin waiting out a
+ * write, so a reader may see a dead server's last values for a few calls. */
+static inline int
+bdshm_read(const struct BdShmHeader *h, unsigned id, uint32_t *values, uint64_t *ntrips) {
+    static uint32_t calls;
+    const struct BdShmDevice *d;
+    uint32_t seq, i, spins;
+    uint64_t n;
+
+    if (id >= h->ndevices || (!(++calls & 1023) && !bdshm_alive(h)))
+        return 0;
+    d = bdshm_device(h, id);
+    do {
+        if (h->magic != BDSHM_MAGIC)
+            return 0;
+        for (spins=1; (seq = d->seq) & 1; ++spins) {
+            /* writer active */
+            if (!(spins & 0xffff) && !bdshm_alive(h))
+                return 0;
+        }
+        __sync_synchronize();
+        for (i=0; i<h->nvars; ++i)
+            values[i] = d->values[i];
+        n = d->ntrips;
+        __sync_synchronize();
+    } while (seq != d->seq);
+    if (ntrips)
+        *ntrips = n;
+    return 1;
+}
+
+#endif